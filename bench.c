@@ -0,0 +1,337 @@
+/*bin/echo  ' -*- mode:c;indent-tabs-mode:nil;c-basic-offset:2;coding:utf-8 -*-┤
+│vi: set net ft=c ts=2 sts=2 sw=2 fenc=utf-8                                :vi│
+╞══════════════════════════════════════════════════════════════════════════════╡
+│ Benchmarks for derasterize, run with: make bench                             │
+╚────────────────────────────────────────────────────────────────────'>/dev/null
+  exec make bench
+  exit
+
+OVERVIEW
+
+  Derasterize Benchmarks
+
+DESCRIPTION
+
+  Times the kernels of derasterize.c on blocks cut from the first image
+  given, then renders every image given at each quality tier, in 24-bit
+  color and with the 256 and 16 color palettes, named e.g. best/256, and
+  with the half blocks of basicidea.c for a baseline. Images are decoded
+  and resized before any timing starts, so neither ImageMagick nor the
+  resampler is counted.
+
+  Each image is also rendered with --shortlist, named e.g. 16of363 for
+  the 16 glyphs nearest in shape out of 363, next to the exhaustive
+  search, named all363, to tell what the speedup costs: the root mean
+  square error of the cells against the image in linear light, and how
+  much higher it is than exhaustive search, in percent.
+
+  Results go to stdout as CSV, one measurement per line:
+
+    bench,subject,mode,sample,value,unit
+
+  where bench is kernel, render or shortlist, and mode and sample are
+  empty when they don't apply. Each value is the best of as many repeats
+  as fit in a quarter second, which is the least noisy number on a busy
+  machine.
+
+FLAGS
+
+  -y N     rows of cells to render, default 40
+  -x N     columns of cells to render, default 80
+  -j N     render threads, default 1                                      */
+
+#define BENCH /* which times adjudicate() whatever SCORE is */
+#define DERASTERIZE_LIBRARY
+#include "derasterize.c"
+
+#define BUDGET 250000000ll /* nanoseconds to spend repeating each test */
+
+static volatile unsigned sink_;
+static unsigned threads_;
+
+/**
+ * Repeats expression until time budget runs out, yielding the fastest.
+ */
+#define FASTEST(NS, EXPR)                               \
+  do {                                                  \
+    long long t0_, t1_, end_;                           \
+    end_ = Nanos() + BUDGET;                            \
+    for ((NS) = -1ull >> 1;;) {                         \
+      t0_ = Nanos();                                    \
+      EXPR;                                             \
+      t1_ = Nanos();                                    \
+      (NS) = MIN((NS), t1_ - t0_);                      \
+      if (t1_ > end_) break;                            \
+    }                                                   \
+  } while (0)
+
+static void Report(const char *bench, const char *subject, const char *mode,
+                   const char *sample, double value, const char *unit) {
+  printf("%s,%s,%s,%s,%.6g,%s\n", bench, subject, mode, sample, value, unit);
+  fflush(stdout);
+}
+
+static unsigned char *LoadSample(char *path, unsigned dy, unsigned dx) {
+  unsigned char *rgb;
+  ORDIE((rgb = LoadImage(path, dy, dx)));
+  return rgb;
+}
+
+/**
+ * Prints packed 8-bit RGB the way basicidea.c does with -t.
+ *
+ * Each cell is an upper half block colored by two pixels, formatted
+ * with sprintf() like basicidea.c formats it with printf().
+ */
+static char *HalfBlocks(char *v, const unsigned char *rgb, unsigned yn,
+                        unsigned xn) {
+  unsigned y, x;
+  const unsigned char *a, *b;
+  for (y = 0; y < yn; y += 2) {
+    if (y) v += sprintf(v, "\r\n");
+    for (x = 0; x < xn; ++x) {
+      a = rgb + ((y + 0) * xn + x) * CN;
+      b = rgb + ((y + 1) * xn + x) * CN;
+      v += sprintf(v, "\033[48;2;%hhu;%hhu;%hhu;38;2;%hhu;%hhu;%hhum▄", a[0],
+                   a[1], a[2], b[0], b[1], b[2]);
+    }
+  }
+  return v + sprintf(v, "\033[0m\r");
+}
+
+static struct derasterize *NewContext(struct derasterize_options *opt) {
+  int rc;
+  struct derasterize *ctx;
+  if ((rc = derasterize_new(&ctx, opt))) {
+    fprintf(stderr, "%s\n", derasterize_strerror(rc));
+    exit(1);
+  }
+  return ctx;
+}
+
+static struct derasterize *NewTier(int quality, unsigned colors) {
+  struct derasterize_options opt = {
+      .quality = quality, .threads = threads_, .colors = colors};
+  return NewContext(&opt);
+}
+
+static void ForgetCells(struct derasterize *ctx) {
+#if MEMO
+  memset(ctx->memo, 0, sizeof(ctx->memo));
+#endif
+}
+
+static void BenchKernels(const unsigned char *rgb, unsigned yn, unsigned xn) {
+  char *v, *p;
+  long long ns;
+  unsigned y, x, g, n, bn;
+  struct Cell c1, *cells;
+  struct derasterize *ctx;
+  unsigned char bf[1u << MC][2], (*blocks)[CN * BN];
+  FLOAT r[GP], (*lb)[CN * BN];
+  bn = yn * xn;
+  ctx = NewTier(BEST, 0);
+  ORDIE((blocks = malloc(bn * sizeof(*blocks))));
+  ORDIE((lb = malloc(bn * sizeof(*lb))));
+  ORDIE((cells = malloc(bn * sizeof(*cells))));
+  ORDIE((v = malloc(ROWMAX(xn))));
+  FASTEST(ns, for (y = 0; y < yn; ++y) {
+    tilecells(blocks + y * xn, rgb + (size_t)y * YS * xn * XS * CN, xn,
+              xn * XS * CN);
+  });
+  Report("kernel", "tilecells", "", "", (double)ns / bn, "ns/block");
+  FASTEST(ns, for (x = 0; x < bn; ++x) rgb2lin(lb[x], blocks[x]));
+  Report("kernel", "rgb2lin", "", "", (double)ns / bn, "ns/block");
+  FASTEST(ns, for (n = x = 0; x < bn; ++x) {
+    n += combinecolors(bf, blocks[x], ctx->pairs);
+  } sink_ = n);
+  Report("kernel", "combinecolors", kTiers[BEST].name, "", (double)ns / bn,
+         "ns/block");
+  FASTEST(ns, for (x = 0; x < bn; ++x) {
+    for (g = 0; g < ctx->glyphs; ++g) {
+      r[g] = adjudicate(ctx, 0, BN - 1, g, lb[x], lb[x]);
+    }
+  } sink_ = r[0]);
+  Report("kernel", "adjudicate", kTiers[BEST].name, "",
+         (double)ns / bn / ctx->glyphs, "ns/glyph");
+  FASTEST(ns, for (x = 0; x < bn; ++x) {
+    adjudicateall(ctx, r, 0, BN - 1, lb[x], lb[x], ctx->glyphs, 0);
+  } sink_ = r[0]);
+  Report("kernel", "adjudicateall", kTiers[BEST].name, "", (double)ns / bn,
+         "ns/pair");
+  for (x = 0; x < bn; ++x) {
+    cells[x] = ctx->derasterize(ctx, blocks[x], lb[x], lb[x]);
+  }
+  p = v;
+  FASTEST(ns, for (y = 0; y < yn; ++y) {
+    c1.rune = 0;
+    for (p = v, x = 0; x < xn; ++x) p = celltoa(p, cells[y * xn + x], &c1, 0);
+  } sink_ = p - v);
+  Report("kernel", "celltoa", "", "", (double)ns / bn, "ns/cell");
+  derasterize_free(ctx);
+  free(v);
+  free(cells);
+  free(lb);
+  free(blocks);
+}
+
+static void BenchRender(char *path, unsigned yn, unsigned xn) {
+  char *v, *e, *sample, mode[32];
+  long long ns;
+  unsigned i, j;
+  size_t n, cap;
+  unsigned char *rgb;
+  struct derasterize *ctx;
+  static const unsigned kColors[] = {0, 256, 16};
+  sample = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  rgb = LoadSample(path, yn * YS, xn * XS);
+  cap = derasterize_bound(yn, xn);
+  ORDIE((v = malloc(cap)));
+  for (j = 0; j < ARRAYLEN(kColors); ++j) {
+    for (i = 0; i < ARRAYLEN(kTiers); ++i) {
+      if (kColors[j]) {
+        sprintf(mode, "%s/%u", kTiers[i].name, kColors[j]);
+      } else {
+        strcpy(mode, kTiers[i].name);
+      }
+      ctx = NewTier(i, kColors[j]);
+      FASTEST(ns, ForgetCells(ctx);
+              derasterize_render(ctx, rgb, xn * XS * CN, yn, xn, v, cap, &n));
+      Report("render", "derasterize", mode, sample, yn * xn / (ns / 1e9),
+             "cells/s");
+      Report("render", "derasterize", mode, sample, (double)n / (yn * xn),
+             "bytes/cell");
+      derasterize_free(ctx);
+    }
+  }
+  free(v);
+  free(rgb);
+  // same # of cells, each of which covers two pixels
+  rgb = LoadSample(path, yn * 2, xn);
+  ORDIE((v = malloc(yn * (xn * 48 + 2) + 8)));
+  FASTEST(ns, e = HalfBlocks(v, rgb, yn * 2, xn));
+  Report("render", "halfblocks", "", sample, yn * xn / (ns / 1e9), "cells/s");
+  Report("render", "halfblocks", "", sample, (double)(e - v) / (yn * xn),
+         "bytes/cell");
+  free(v);
+  free(rgb);
+}
+
+/**
+ * Returns squared error of cell against block in linear light.
+ */
+static double CellError(const unsigned char block[CN * BN], struct Cell c) {
+  unsigned i, k, g;
+  double e;
+  glyph_t m;
+  for (m = g = 0; g < GT; ++g) {
+    if (kRunes[g] == c.rune) {
+      m = kShapes[g];
+      break;
+    }
+  }
+  for (e = i = 0; i < BN; ++i) {
+    for (k = 0; k < CN; ++k) {
+      e += SQR(kLinear[(m >> i & 1 ? c.fg : c.bg)[k]] -
+               kLinear[block[k * BN + i]]);
+    }
+  }
+  return e;
+}
+
+static void BenchShortlist(char *path, unsigned yn, unsigned xn) {
+  char *v, *sample, mode[32];
+  long long ns;
+  unsigned i, j, x, y, bn;
+  size_t n, cap;
+  double e, e0;
+  unsigned char *rgb, (*blocks)[CN * BN];
+  FLOAT(*lb)[CN * BN];
+  struct derasterize *ctx;
+  struct derasterize_options opt = {.threads = threads_};
+  static const unsigned kShortlists[] = {0, 4, 8, 16, 32};
+  static const char *const kGlyphs[] = {"44", "363"};
+  sample = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  rgb = LoadSample(path, yn * YS, xn * XS);
+  bn = yn * xn;
+  cap = derasterize_bound(yn, xn);
+  ORDIE((v = malloc(cap)));
+  ORDIE((blocks = malloc(bn * sizeof(*blocks))));
+  ORDIE((lb = malloc(bn * sizeof(*lb))));
+  for (y = 0; y < yn; ++y) {
+    tilecells(blocks + y * xn, rgb + (size_t)y * YS * xn * XS * CN, xn,
+              xn * XS * CN);
+  }
+  for (x = 0; x < bn; ++x) rgb2lin(lb[x], blocks[x]);
+  for (j = 0; j < ARRAYLEN(kGlyphs); ++j) {
+    for (e0 = i = 0; i < ARRAYLEN(kShortlists); ++i) {
+      opt.glyphs = kGlyphs[j];
+      opt.shortlist = kShortlists[i];
+      if (opt.shortlist) {
+        sprintf(mode, "%uof%s", opt.shortlist, opt.glyphs);
+      } else {
+        sprintf(mode, "all%s", opt.glyphs);
+      }
+      ctx = NewContext(&opt);
+      for (e = x = 0; x < bn; ++x) {
+        e += CellError(blocks[x],
+                       ctx->derasterize(ctx, blocks[x], lb[x], lb[x]));
+      }
+      e = sqrt(e / (bn * BN * CN));
+      if (!i) e0 = e;
+      FASTEST(ns, ForgetCells(ctx);
+              derasterize_render(ctx, rgb, xn * XS * CN, yn, xn, v, cap, &n));
+      Report("shortlist", "derasterize", mode, sample, bn / (ns / 1e9),
+             "cells/s");
+      Report("shortlist", "derasterize", mode, sample, e, "rmse");
+      Report("shortlist", "derasterize", mode, sample, (e / e0 - 1) * 100,
+             "% rmse");
+      derasterize_free(ctx);
+    }
+  }
+  free(lb);
+  free(blocks);
+  free(v);
+  free(rgb);
+}
+
+int main(int argc, char *argv[]) {
+  int i;
+  unsigned yn, xn;
+  unsigned char *rgb;
+  yn = 40;
+  xn = 80;
+  threads_ = 1;
+  btoa(0, 0);
+  initlinear();
+  while ((i = getopt(argc, argv, "y:x:j:")) != -1) {
+    switch (i) {
+      case 'y':
+        yn = atoi(optarg);
+        break;
+      case 'x':
+        xn = atoi(optarg);
+        break;
+      case 'j':
+        threads_ = atoi(optarg);
+        break;
+      default:
+        return 1;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, "usage: %s [-y N] [-x N] [-j N] IMAGE...\n", argv[0]);
+    return 1;
+  }
+  printf("bench,subject,mode,sample,value,unit\n");
+  rgb = LoadSample(argv[optind], yn * YS, xn * XS);
+  BenchKernels(rgb, yn, xn);
+  free(rgb);
+  for (i = optind; i < argc; ++i) {
+    BenchRender(argv[i], yn, xn);
+  }
+  for (i = optind; i < argc; ++i) {
+    BenchShortlist(argv[i], yn, xn);
+  }
+  return 0;
+}
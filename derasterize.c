@@ -15,8 +15,9 @@
 │ ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      │
 │ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               │
 ╞══════════════════════════════════════════════════════════════════════════════╡
-│ To use this, install a compiler and (for now) imagemagick:                   │
-│  apt install build-essential imagemagick                                     │
+│ To use this, install a compiler, and libpng, libjpeg, or imagemagick to read │
+│ more than netpbm, bmp, farbfeld and qoi files:                               │
+│  apt install build-essential libpng-dev libjpeg-dev imagemagick              │
 │                                                                              │
 │ Then make this file executable or run it with sh:                            │
 │  chmod +x derasterize.c                                                      │
@@ -32,8 +33,18 @@
       CC=$(command -v gcc) ||
       CC=$(command -v cc)
     fi
-    COPTS="-g -march=native -Ofast"
-    $CC $COPTS -o "${0%.*}" "$0" -lm || exit
+    COPTS="-g -march=native -Ofast -pthread"
+    LIBS="-lm -lpthread"
+    if echo '#include <png.h>' | $CC -E -x c - >/dev/null 2>&1; then
+      COPTS="$COPTS -DHAVE_PNG"
+      LIBS="$LIBS -lpng"
+    fi
+    if printf '#include <stdio.h>\n#include <jpeglib.h>\n' |
+       $CC -E -x c - >/dev/null 2>&1; then
+      COPTS="$COPTS -DHAVE_JPEG"
+      LIBS="$LIBS -ljpeg"
+    fi
+    $CC $COPTS -o "${0%.*}" "$0" $LIBS || exit
   fi
   exec ./"${0%.*}" "$@"
   exit
@@ -47,7 +58,9 @@ NAME\n\
 \n\
 SYNOPSIS\n\
 \n\
-  derasterize [PNG|JPG|ETC]...\n\
+  derasterize [PNG|JPG|PPM|BMP|QOI|ETC]...\n\
+  derasterize -o DIR [PNG|JPG|PPM|BMP|QOI|ETC]...\n\
+  derasterize [-r FPS] [-s WxH] - < FRAMES\n\
 \n\
 DESCRIPTION\n\
 \n\
@@ -63,11 +76,84 @@ DESCRIPTION\n\
   -y\n\
           If Y is positive, hardcode the height in caracters to Y\n\
           If Y is negative, remove as much from the fullscreen height\n\
+\n\
+  Pictures are resized in linear light, by area averaging by default:\n\
+  -f box|lanczos\n\
+          Use a three lobed Lanczos filter instead, for more sharpness\n\
+\n\
+  The search for the best glyph and colors of each cell can be traded\n\
+  for speed, and restricted to the glyphs a font has:\n\
+  -q best|fast|faster|means\n\
+          Consider fewer color pairs, fewer glyphs, or solve for colors\n\
+  --pairs=N\n\
+          Consider at most N (bg,fg) color pairs per cell, up to 512\n\
+  --glyphs=N|RUNES\n\
+          Consider the first N glyphs, or only those listed, e.g. 25\n\
+          sticks to the block elements, without box drawings, and 363\n\
+          adds eighth width blocks, sextants and braille to them all\n\
+  --tolerance=X\n\
+          Settle for the first cell within X root mean square error of\n\
+          the block in linear light, e.g. 0.02, rather than the best\n\
+  --flat=X\n\
+          Paint blocks deviating less than X root mean square from their\n\
+          mean in linear light as a space of that color, e.g. 0.005\n\
+  --smooth=X\n\
+          Search blocks deviating less than X as -q faster would, e.g.\n\
+          0.03, and only search the others as hard as -q says\n\
+  --shortlist=N\n\
+          Only score the N glyphs whose shape is nearest to the block's,\n\
+          e.g. 16 of --glyphs=363, rather than all of them\n\
+  -c 256|16\n\
+          Use colors of the xterm palette rather than 24-bit ones, for\n\
+          terminals and multiplexers without, which takes fewer bytes\n\
+  -p\n\
+          Draw half blocks at once, then draw over them row by row as\n\
+          the search finds the glyphs, when the picture fits the screen\n\
+  --stats\n\
+          Print time spent in each stage, throughput, early exits, cache\n\
+          hits, CPU counters and glyph usage to stderr when done\n\
+\n\
+  Previews start quicker from a daemon, which keeps its tables, threads\n\
+  and the text of recent pictures around between calls:\n\
+  --daemon[=SOCKET]\n\
+          Render for clients on a unix socket, which by default is\n\
+          $XDG_RUNTIME_DIR/derasterize.sock or /tmp/derasterize-UID.sock\n\
+  --cache=N\n\
+          Remember the text of the last N pictures rendered, default 64\n\
+  --connect[=SOCKET]\n\
+          Have the daemon render the picture, at the quality of -q and\n\
+          with its own other settings, or render it here if none answers\n\
+\n\
+  Several pictures are converted in one go, decoding the next one and\n\
+  writing the last one while rendering the current one:\n\
+  -o DIR\n\
+          Save the text of each picture to DIR, named after the picture\n\
+          with a suffix, rather than writing them all to stdout\n\
+  --suffix=EXT\n\
+          Suffix of the files saved with -o, by default .uaart\n\
+\n\
+  Rendering is spread over all online processors by default:\n\
+  -j N\n\
+          Use N threads to render rows of cells, 1 being the serial path\n\
+\n\
+  When the file is -, frames of video are read from standard input and\n\
+  drawn over each other, only sending the cells that changed. Streams\n\
+  of P6 pixmaps and yuv4mpeg2 are told apart by their signature, and\n\
+  anything else is taken as raw rgb24:\n\
+  -s WxH\n\
+          Size of raw rgb24 frames, which have no header\n\
+  -r FPS\n\
+          Play at FPS frames per second, dropping frames to keep up\n\
+          Defaults to the y4m frame rate, or as fast as possible\n\
 \n\
 EXAMPLES\n\
 \n\
   $ ./derasterize.c samples/wave.png > wave.uaart\n\
   $ cat wave.uaart\n\
+  $ ./derasterize.c -y20 -x70 -o thumbs pictures/*.jpg\n\
+  $ ffmpeg -i movie.mkv -f yuv4mpegpipe - | ./derasterize.c -\n\
+  $ ./derasterize --daemon &\n\
+  $ ./derasterize --connect -y20 -x40 samples/wave.png\n\
 \n\
 AUTHORS\n\
 \n\
@@ -80,28 +166,41 @@ __asm__(".ident\t\"\\n\\n\
 derasterize (ISC License)\\n\
 Copyright 2019 Csdvrx & Justine Alexandra Roberts Tunney\"");
 #endif
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <fenv.h>
 #include <limits.h>
 #include <locale.h>
 #include <malloc.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 // Can be missing in msys2
 #include <uchar.h>
+#include "derasterize.h"
 
 #define BEST 0
 #define FAST 1
 #define FASTER 2
+#define MEANS 3 /* fit bg and fg to each glyph rather than picking pixels */
 
 #ifndef MODE
 #ifdef __AVX2__
@@ -111,27 +210,66 @@ Copyright 2019 Csdvrx & Justine Alexandra Roberts Tunney\"");
 #endif
 #endif
 
-// TODO: we should make that runtime choices, with separate command line options for MC and GN
-
-#if MODE == BEST
-#define MC 9u  /* log2(#) of color combos to consider */
-// FIXME: shouldn't that be 44 in best? Or maybe declare mode A, mode B, etc.
-#define GN 35u /* # of glyphs to consider */
-#elif MODE == FAST
-#define MC 6u
-#define GN 35u
-#elif MODE == FASTER
-#define MC 4u
-#define GN 25u
+#define PIXELS 0  /* score every pixel of each synthetic block */
+#define MOMENTS 1 /* score from per-glyph sums, faster but not to the bit */
+
+#ifndef SCORE
+#define SCORE PIXELS
+#endif
+
+/* Width in bits of the vector kernels, or 0 for the scalar reference */
+#ifndef SIMD
+#if defined(__AVX512F__)
+#define SIMD 512
+#elif defined(__AVX2__) && defined(__FMA__)
+#define SIMD 256
+#else
+#define SIMD 0
+#endif
+#endif
+
+/* log2 of slots in the cache of rendered blocks, or 0 for none */
+#ifndef MEMO
+#define MEMO 13
+#endif
+
+#if SIMD
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#ifdef HAVE_PNG
+#include <png.h>
+#endif
+#ifdef HAVE_JPEG
+#include <jpeglib.h>
 #endif
 
 #define FLOAT float
 #define FLOAT_C(X) X##f
 #define CN 3u        /* # channels (rgb) */
-#define YS 8u        /* row stride -or- block height */
-#define XS 4u        /* column stride -or- block width */
-#define GT 44u       /* total glyphs */
+#define YS (DERASTERIZE_CELLHEIGHT + 0u) /* row stride -or- block height */
+#define XS (DERASTERIZE_CELLWIDTH + 0u)  /* column stride -or- block width */
+#define GA 44u       /* glyphs drawn as 4×8 art */
+#define GT (GA + 4u + 60u + 255u) /* total glyphs, see initshapes() */
+#define MC 9u        /* log2(#) of most color combos to consider */
 #define BN (YS * XS) /* # scalars in block/glyph plane */
+#define CC 32u       /* # pixels whose colors are candidates, see below */
+#define CS (BN / CC) /* stride of those pixels */
+#define GP ((GT + 15u) & -16u) /* GT rounded up to whole vectors */
+
+_Static_assert(BN % 32 == 0 && BN <= 128,
+               "cells must have a multiple of 32 pixels, and at most 128");
+
+/* Glyph bitmask of BN bits, one per pixel in row-major order */
+#if BN <= 32
+typedef uint32_t glyph_t;
+#elif BN <= 64
+typedef uint64_t glyph_t;
+#else
+typedef unsigned __int128 glyph_t;
+#endif
 
 #define PHIPRIME 0x9E3779B1u
 #define SQR(X) ((X) * (X))
@@ -182,7 +320,7 @@ Copyright 2019 Csdvrx & Justine Alexandra Roberts Tunney\"");
 
 // The glyph size it set by the resolution of the most precise mode, ex:
 // - Mode C: along the X axis, need >= 8 steps for the 8 fractional width
-// FIXME: now we can only use 4 chars instead of the extra ▉,▊,▋,▌,▍,▎,▏
+// so 4 wide cells only tell 4 of ▉,▊,▋,▌,▍,▎,▏ apart, see initshapes()
 //
 // - Mode X: along the Y axis, need >= 8 steps to separate the maximal 6 dots
 // from the space left below, seen by overimposing an underline  ⠿_ 
@@ -192,7 +330,7 @@ Copyright 2019 Csdvrx & Justine Alexandra Roberts Tunney\"");
 // - we shouldn't use square glyphs, 8x16 seems to be the minimal size
 // - we should adapt the conversion to BMP to avoid accidental Y downsampling
 
-static const uint32_t kGlyphs[GT] = /* clang-format off */ {
+static const uint32_t kGlyphs[GA] = /* clang-format off */ {
     /* U+0020 ' ' empty block [ascii:20,cp437:20] */
     G(0,0,0,0,
       0,0,0,0,
@@ -631,7 +769,7 @@ static const uint32_t kGlyphs[GT] = /* clang-format off */ {
       0,0,0,0),
 } /* clang-format on */;
 
-static const char16_t kRunes[GT] = {
+static char32_t kRunes[GT] = {
     u' ', /* 0020 empty block [ascii:20,cp437:20] */
     u'█', /* 2588 full block [cp437] */
     u'▄', /* 2584 lower half block [cp437:dc] */
@@ -676,8 +814,66 @@ static const char16_t kRunes[GT] = {
     u'═', /* 2550 box drawings double horizontal */
     u'⎻', /* 23BB horizontal scan line 3 */
     u'⎼', /* 23BD horizontal scan line 9 */
+    /* the rest are filled by initshapes() */
 };
 
+/**
+ * Every glyph as drawn on the YS×XS grid of a cell, filled by initshapes().
+ */
+static glyph_t kShapes[GT];
+
+/**
+ * Draws every glyph on the grid that cells are cut into.
+ *
+ * The art above is scaled from 4×8 by nearest neighbor. The glyphs it
+ * has no room for are drawn from their geometry instead, covering each
+ * pixel whose center they cover: the eighth width blocks ▉▋▍▏, the
+ * sextants U+1FB00 to U+1FB3B, which split cells 2×3, and the braille
+ * patterns U+2801 to U+28FF, which have a dot in the middle of each
+ * part of a 2×4 split. On coarse grids some of these come out the same
+ * as other glyphs, and pickglyphs() leaves them out.
+ *
+ * @note call initshapes() once at startup
+ */
+static void initshapes(void) {
+  glyph_t m;
+  unsigned g, i, y, x, n, r, c, on;
+  for (g = 0; g < GT; ++g) {
+    n = 0;
+    if (GA <= g && g < GA + 4) {
+      kRunes[g] = 0x2589 + (g - GA) * 2;
+      n = 7 - (g - GA) * 2; /* eighths covered from the left */
+    } else if (GA + 4 <= g && g < GA + 64) {
+      kRunes[g] = 0x1FB00 + (g - GA - 4);
+      n = g - GA - 4 + 1; /* sextants 1 2 / 3 4 / 5 6 as bits */
+      n += n >= 21;       /* skipping ▌ */
+      n += n >= 42;       /* skipping ▐ */
+    } else if (GA + 64 <= g) {
+      kRunes[g] = 0x2801 + (g - GA - 64);
+      n = g - GA - 64 + 1; /* braille dots 1 to 8 as bits */
+    }
+    for (m = i = y = 0; y < YS; ++y) {
+      for (x = 0; x < XS; ++x, ++i) {
+        if (g < GA) {
+          on = kGlyphs[g] >> (y * 8 / YS * 4 + x * 4 / XS) & 1;
+        } else if (g < GA + 4) {
+          on = (2 * x + 1) * 4 < n * XS;
+        } else if (g < GA + 64) {
+          on = n >> ((2 * y + 1) * 3 / (2 * YS) * 2 + (2 * x + 1) / XS) & 1;
+        } else {
+          // quarters of the 2×4 parts, the dots covering the middle two
+          c = (2 * x + 1) * 4 / XS;
+          r = (2 * y + 1) * 8 / YS;
+          on = (c & 3) - 1 < 2 && (r & 3) - 1 < 2 &&
+               (n >> (r / 4 < 3 ? c / 4 * 3 + r / 4 : 6 + c / 4) & 1);
+        }
+        m |= (glyph_t)on << i;
+      }
+    }
+    kShapes[g] = m;
+  }
+}
+
 /*───────────────────────────────────────────────────────────────────────────│─╗
 │ derasterize § encoding                                                   ─╬─│┼
 ╚────────────────────────────────────────────────────────────────────────────│*/
@@ -786,6 +982,51 @@ static char *btoa(char *p, int c) {
   }
 }
 
+/**
+ * Formats unsigned integer to array as decimal.
+ *
+ * @param p needs at least 10 bytes
+ * @return p + number of bytes written, cf. mempcpy
+ */
+static char *utoa(char *p, unsigned x) {
+  char *e;
+  unsigned n;
+  for (n = 1; x / 10 >= n; n *= 10) {
+  }
+  for (e = p; n; n /= 10) *e++ = '0' + x / n % 10;
+  return e;
+}
+
+/**
+ * Formats ANSI sequence moving cursor to zero-indexed row and column.
+ *
+ * @param p needs at least 24 bytes
+ */
+static char *cuptoa(char *p, unsigned y, unsigned x) {
+  *p++ = 033;
+  *p++ = '[';
+  p = utoa(p, y + 1);
+  if (x) {
+    *p++ = ';';
+    p = utoa(p, x + 1);
+  }
+  *p++ = 'H';
+  return p;
+}
+
+/**
+ * Formats ANSI sequence moving cursor n columns forward.
+ *
+ * @param p needs at least 13 bytes
+ */
+static char *cuftoa(char *p, unsigned n) {
+  *p++ = 033;
+  *p++ = '[';
+  if (n > 1) p = utoa(p, n);
+  *p++ = 'C';
+  return p;
+}
+
 /*───────────────────────────────────────────────────────────────────────────│─╗
 │ derasterize § colors                                                     ─╬─│┼
 ╚────────────────────────────────────────────────────────────────────────────│*/
@@ -822,305 +1063,4041 @@ static FLOAT frgb2linl(FLOAT x) {
   return x < FLOAT_C(0.04045) ? r1 : r2;
 }
 
+/**
+ * Linearized value of each sRGB byte.
+ */
+static FLOAT kLinear[256];
+
+/**
+ * sRGB byte closest to each linear value in 1/65535 steps.
+ */
+static unsigned char kSrgb[65536];
+
+/**
+ * Fills kLinear and kSrgb.
+ * @note call initlinear() once at startup
+ */
+static void initlinear(void) {
+  unsigned i, b;
+  for (i = 0; i < 256; ++i) {
+    kLinear[i] = frgb2linl(i / FLOAT_C(255.0));
+  }
+  for (b = i = 0; i < 65536; ++i) {
+    while (b < 255 && kLinear[b] + kLinear[b + 1] <= i / FLOAT_C(32767.5)) {
+      ++b;
+    }
+    kSrgb[i] = b;
+  }
+}
+
+/**
+ * Converts linear value back to the sRGB byte closest to it.
+ */
+static unsigned char lin2rgb(FLOAT x) {
+  unsigned i, w;
+  for (i = 0, w = 128; w; w >>= 1) {
+    if (i + w < 256 && kLinear[i + w] <= x) i += w;
+  }
+  if (i < 255 && kLinear[i + 1] - x < x - kLinear[i]) ++i;
+  return i;
+}
+
 /**
  * Converts standard RGB to linear RGB.
  *
  * This makes subtraction look good by flattening out the bias curve
- * that PC display manufacturers like to use.
+ * that PC display manufacturers like to use. There being only 256
+ * bytes, the curve is looked up rather than evaluated.
  */
 static void rgb2lin(FLOAT f[CN * BN], const unsigned char u[CN * BN]) {
   unsigned i;
-  for (i = 0; i < CN * BN; ++i) f[i] = u[i];
-  for (i = 0; i < CN * BN; ++i) f[i] /= FLOAT_C(255.0);
-  for (i = 0; i < CN * BN; ++i) f[i] = frgb2linl(f[i]);
+  for (i = 0; i < CN * BN; ++i) f[i] = kLinear[u[i]];
 }
 
-/*───────────────────────────────────────────────────────────────────────────│─╗
-│ derasterize § blocks                                                     ─╬─│┼
-╚────────────────────────────────────────────────────────────────────────────│*/
+/**
+ * Colors of the xterm 256 color palette, the first sixteen being the
+ * defaults of xterm, since terminals let users theme those.
+ */
+static unsigned char kPalette[256][CN];
 
-struct Cell {
-  char16_t rune;
-  unsigned char bg[CN], fg[CN];
-};
+/**
+ * Linearized kPalette, which is what palette colors get scored by.
+ */
+static FLOAT kPaletteLinear[256][CN];
 
 /**
- * Serializes ANSI background, foreground, and UNICODE glyph to wire.
+ * Index of the 6×6×6 color cube level and the gray ramp level closest
+ * to each sRGB byte in linear light.
  */
-static char *celltoa(char *p, struct Cell cell, struct Cell last) {
-  *p++ = 033;
-  *p++ = '[';
-  *p++ = '4';
-  *p++ = '8';
-  *p++ = ';';
-  *p++ = '2';
-  *p++ = ';';
-  p = btoa(p, cell.bg[0]);
-  *p++ = ';';
-  p = btoa(p, cell.bg[1]);
-  *p++ = ';';
-  p = btoa(p, cell.bg[2]);
-  *p++ = ';';
-  *p++ = '3';
-  *p++ = '8';
-  *p++ = ';';
-  *p++ = '2';
-  *p++ = ';';
-  p = btoa(p, cell.fg[0]);
-  *p++ = ';';
-  p = btoa(p, cell.fg[1]);
-  *p++ = ';';
-  p = btoa(p, cell.fg[2]);
-  *p++ = 'm';
-  p = tptoa(p, cell.rune);
-  return p;
-}
+static unsigned char kCube[256], kGray[256];
 
 /**
- * Picks ≤2**MC unique (bg,fg) pairs from product of lb.
+ * Fills kPalette, kPaletteLinear, kCube and kGray.
+ * @note call initpalette() once after initlinear()
  */
-static unsigned combinecolors(unsigned char bf[1u << MC][2],
-                              const unsigned char bl[CN * BN]) {
-  uint64_t hv, ht[(1u << MC) * 2];
-  unsigned i, j, n, b, f, h, hi, bu, fu;
-  memset(ht, 0, sizeof(ht));
-  for (n = b = 0; b < BN && n < (1u << MC); ++b) {
-    bu = bl[2 * BN + b] << 020 | bl[1 * BN + b] << 010 | bl[0 * BN + b];
-    hi = 0;
-    hi = (((bu >> 000) & 0xff) + hi) * PHIPRIME;
-    hi = (((bu >> 010) & 0xff) + hi) * PHIPRIME;
-    hi = (((bu >> 020) & 0xff) + hi) * PHIPRIME;
-    for (f = b + 1; f < BN && n < (1u << MC); ++f) {
-      fu = bl[2 * BN + f] << 020 | bl[1 * BN + f] << 010 | bl[0 * BN + f];
-      h = hi;
-      h = (((fu >> 000) & 0xff) + h) * PHIPRIME;
-      h = (((fu >> 010) & 0xff) + h) * PHIPRIME;
-      h = (((fu >> 020) & 0xff) + h) * PHIPRIME;
-      h = h & 0xffff;
-      h = MAX(1, h);
-      hv = 0;
-      hv <<= 030;
-      hv |= fu;
-      hv <<= 030;
-      hv |= bu;
-      hv <<= 020;
-      hv |= h;
-      for (i = 0;; ++i) {
-        j = (h + i * (i + 1) / 2) & (ARRAYLEN(ht) - 1);
-        if (!ht[j]) {
-          ht[j] = hv;
-          bf[n][0] = b;
-          bf[n][1] = f;
-          n++;
-          break;
-        } else if (ht[j] == hv) {
-          break;
-        }
+static void initpalette(void) {
+  unsigned i, j, k, v;
+  static const unsigned char kLevels[6] = {0, 95, 135, 175, 215, 255};
+  static const unsigned char kSystem[16][CN] = {
+      {0x00, 0x00, 0x00}, {0xcd, 0x00, 0x00}, {0x00, 0xcd, 0x00},
+      {0xcd, 0xcd, 0x00}, {0x00, 0x00, 0xee}, {0xcd, 0x00, 0xcd},
+      {0x00, 0xcd, 0xcd}, {0xe5, 0xe5, 0xe5}, {0x7f, 0x7f, 0x7f},
+      {0xff, 0x00, 0x00}, {0x00, 0xff, 0x00}, {0xff, 0xff, 0x00},
+      {0x5c, 0x5c, 0xff}, {0xff, 0x00, 0xff}, {0x00, 0xff, 0xff},
+      {0xff, 0xff, 0xff},
+  };
+  memcpy(kPalette, kSystem, sizeof(kSystem));
+  for (i = 0; i < 216; ++i) {
+    kPalette[16 + i][0] = kLevels[i / 36];
+    kPalette[16 + i][1] = kLevels[i / 6 % 6];
+    kPalette[16 + i][2] = kLevels[i % 6];
+  }
+  for (i = 0; i < 24; ++i) {
+    kPalette[232 + i][0] = kPalette[232 + i][1] = kPalette[232 + i][2] =
+        8 + 10 * i;
+  }
+  for (i = 0; i < 256; ++i) {
+    for (k = 0; k < CN; ++k) kPaletteLinear[i][k] = kLinear[kPalette[i][k]];
+  }
+  for (v = 0; v < 256; ++v) {
+    for (j = 0, i = 1; i < 6; ++i) {
+      if (ABS(kLinear[kLevels[i]] - kLinear[v]) <
+          ABS(kLinear[kLevels[j]] - kLinear[v])) {
+        j = i;
+      }
+    }
+    kCube[v] = j;
+    for (j = 0, i = 1; i < 24; ++i) {
+      if (ABS(kLinear[8 + 10 * i] - kLinear[v]) <
+          ABS(kLinear[8 + 10 * j] - kLinear[v])) {
+        j = i;
       }
     }
+    kGray[v] = j;
   }
-  return n;
 }
 
 /**
- * Computes distance between synthetic block and actual.
+ * Converts linear value back to sRGB byte by table, a step coarser than
+ * lin2rgb() at worst, which doesn't matter for picking palette colors.
  */
-static FLOAT adjudicate(unsigned b, unsigned f, unsigned g,
-                        const FLOAT lb[CN * BN]) {
-  unsigned i, k, gu;
-  FLOAT p[BN], q[BN], fu, bu, r;
-  memset(q, 0, sizeof(q));
-  for (k = 0; k < CN; ++k) {
-    gu = kGlyphs[g];
-    bu = lb[k * BN + b];
-    fu = lb[k * BN + f];
-    for (i = 0; i < BN; ++i) p[i] = (gu & (1u << i)) ? fu : bu;
-    for (i = 0; i < BN; ++i) p[i] -= lb[k * BN + i];
-    // For a minimization problem, abs could do, but not faster in practice
-    for (i = 0; i < BN; ++i) p[i] *= p[i];
-    for (i = 0; i < BN; ++i) q[i] += p[i];
-  }
-  r = 0;
-  // sqrt(x) is strictly increasing in x
-  // so arg min sqrt(x) = arg min x
-  // so we can go faster by simply commenting out
-  // for (i = 0; i < BN; ++i) q[i] = SQRT(q[i]);
-  for (i = 0; i < BN; ++i) r += q[i];
-  return r;
+static unsigned char lin2byte(FLOAT x) {
+  return kSrgb[(unsigned)(MIN(MAX(x, 0), 1) * 65535 + FLOAT_C(.5))];
+}
+
+static FLOAT palettedistance(unsigned i, const FLOAT c[CN]) {
+  return SQR(kPaletteLinear[i][0] - c[0]) + SQR(kPaletteLinear[i][1] - c[1]) +
+         SQR(kPaletteLinear[i][2] - c[2]);
 }
 
 /**
- * Converts tiny bitmap graphic into unicode glyph.
+ * Picks palette color closest to linear color in linear light.
+ *
+ * With 256 colors that's either the nearest color of the cube or of the
+ * gray ramp, each of which is looked up per channel. The sixteen system
+ * colors are left out, since their look depends on the theme. With 16
+ * colors, all of them are tried.
  */
-static struct Cell derasterize(unsigned char block[CN * BN]) {
-  struct Cell cell;
-  FLOAT r, best, lb[CN * BN];
-  unsigned i, n, b, f, g;
-  unsigned char bf[1u << MC][2];
-  rgb2lin(lb, block);
-  n = combinecolors(bf, block);
-  best = -1u;
-  cell.rune = 0;
-  for (i = 0; i < n; ++i) {
-    b = bf[i][0];
-    f = bf[i][1];
-    for (g = 0; g < GN; ++g) {
-      r = adjudicate(b, f, g, lb);
-      if (r < best) {
-        best = r;
-        cell.rune = kRunes[g];
-        cell.bg[0] = block[0 * BN + b];
-        cell.bg[1] = block[1 * BN + b];
-        cell.bg[2] = block[2 * BN + b];
-        cell.fg[0] = block[0 * BN + f];
-        cell.fg[1] = block[1 * BN + f];
-        cell.fg[2] = block[2 * BN + f];
-        if (!r) return cell;
-      }
+static unsigned char nearest(unsigned colors, const FLOAT c[CN]) {
+  unsigned i, best, cube, gray;
+  if (colors == 16) {
+    for (best = 0, i = 1; i < 16; ++i) {
+      if (palettedistance(i, c) < palettedistance(best, c)) best = i;
     }
+    return best;
   }
-  return cell;
+  cube = 16 + kCube[lin2byte(c[0])] * 36 + kCube[lin2byte(c[1])] * 6 +
+         kCube[lin2byte(c[2])];
+  gray = 232 + kGray[lin2byte((c[0] + c[1] + c[2]) / 3)];
+  return palettedistance(cube, c) <= palettedistance(gray, c) ? cube : gray;
 }
 
-/*───────────────────────────────────────────────────────────────────────────│─╗
-│ derasterize § graphics                                                   ─╬─│┼
-╚────────────────────────────────────────────────────────────────────────────│*/
+/**
+ * Palette color nearest() picks for the middle of each rgb555 bucket,
+ * with 256 colors and with 16 colors.
+ */
+static unsigned char kQuantize[2][1u << 15];
 
 /**
- * Turns packed 8-bit RGB graphic into ANSI UNICODE text.
+ * Fills kQuantize, which takes about a millisecond.
+ * @note call initquantize() once after initpalette(), if colors are used
  */
-static char *RenderImage(char *vt, const unsigned char *rgb, unsigned yn,
-                         unsigned xn) {
-  char *v;
-  struct Cell c1, c2;
-  unsigned y, x, i, j, k, w;
-  unsigned char block[CN * BN];
-  const unsigned char *rows[YS];
-  v = vt;
-  c1.rune = 0;
-  rgb -= (w = xn * XS * CN);
-  for (y = 0; y < yn; ++y) {
-    if (y) {
-      while (v > vt && v[-1] == ' ') --v;
-      *v++ = '\r';
-      *v++ = '\n';
-    }
-    for (i = 0; i < YS; ++i) {
-      rows[i] = (rgb += w) - XS * CN;
-    }
-    for (x = 0; x < xn; ++x) {
-      for (i = 0; i < YS; ++i) {
-        rows[i] += XS * CN;
-        for (j = 0; j < XS; ++j) {
-          for (k = 0; k < CN; ++k) {
-            block[(k * YS + i) * XS + j] = rows[i][j * CN + k];
-          }
-        }
-      }
-      c2 = derasterize(block);
-      v = celltoa(v, c2, c1);
-      c1 = c2;
-    }
+static void initquantize(void) {
+  unsigned i;
+  FLOAT c[CN];
+  for (i = 0; i < 1u << 15; ++i) {
+    c[0] = kLinear[(i >> 10) << 3 | 4];
+    c[1] = kLinear[(i >> 5 & 31) << 3 | 4];
+    c[2] = kLinear[(i & 31) << 3 | 4];
+    kQuantize[0][i] = nearest(256, c);
+    kQuantize[1][i] = nearest(16, c);
+  }
+}
+
+/**
+ * Picks palette color closest to sRGB color, by table.
+ */
+static inline unsigned char quantize(unsigned colors, unsigned r, unsigned g,
+                                     unsigned b) {
+  return kQuantize[colors == 16][(r >> 3) << 10 | (g >> 3) << 5 | b >> 3];
+}
+
+/**
+ * Converts linear color to what a cell holds, which is either rgb, or
+ * the index of the closest palette color followed by zeroes.
+ */
+static void paint(unsigned char u[CN], unsigned colors, const FLOAT c[CN]) {
+  unsigned k;
+  for (k = 0; k < CN; ++k) u[k] = lin2rgb(c[k]);
+  if (colors) {
+    u[0] = quantize(colors, u[0], u[1], u[2]);
+    u[1] = u[2] = 0;
+  }
+}
+
+/**
+ * Quantizes each pixel of block to the palette, so the search picks
+ * its pairs of colors among palette colors.
+ *
+ * @param qb receives palette indices in the first plane and zeroes in
+ *     the others, which is what cells hold
+ * @param ql receives the palette colors in linear light
+ */
+static void quantizeblock(unsigned char qb[CN * BN], FLOAT ql[CN * BN],
+                          const unsigned char block[CN * BN],
+                          unsigned colors) {
+  unsigned i, k;
+  for (i = 0; i < BN; ++i) {
+    qb[i] = quantize(colors, block[i], block[BN + i], block[2 * BN + i]);
+  }
+  memset(qb + BN, 0, (CN - 1) * BN);
+  for (k = 0; k < CN; ++k) {
+    for (i = 0; i < BN; ++i) ql[k * BN + i] = kPaletteLinear[qb[i]][k];
   }
-  return v;
 }
 
 /*───────────────────────────────────────────────────────────────────────────│─╗
-│ derasterize § systems                                                    ─╬─│┼
+│ derasterize § statistics                                                 ─╬─│┼
 ╚────────────────────────────────────────────────────────────────────────────│*/
 
-static void PrintImage(void *rgb, unsigned yn, unsigned xn) {
-  char *v, *vt;
-  vt = valloc(yn * (xn * (32 + (2 + (1 + 3) * 3) * 2 + 1 + 3)) * 1 + 5 + 1);
-  v = RenderImage(vt, rgb, yn, xn);
-  *v++ = '\r';
-  *v++ = 033;
-  *v++ = '[';
-  *v++ = '0';
-  *v++ = 'm';
-  write(1, vt, v - vt);
-  free(vt);
+#define DECODING 0
+#define RESIZING 1
+#define TILING 2
+#define MATCHING 3    /* memo, adapt() and derasterize(), which has: */
+#define LINEARIZING 4 /*   rgb2lin() */
+#define PAIRING 5     /*   combinecolors(), bounds() and rankglyphs() */
+#define SCORING 6     /*   adjudicating glyphs against pairs */
+#define ENCODING 7
+#define WRITING 8
+#define STAGES 9
+
+/**
+ * Totals printed by --stats, which are only kept if it was passed.
+ *
+ * Stages that run on several threads add up the time of each of them.
+ * CPU time isn't taken for the stages within matching, since they're
+ * timed per block, where clock_gettime() is only cheap for wall time.
+ */
+static struct Stats {
+  int on;
+  int cycles, instructions; /* perf_event_open() fds, or -1 */
+  long long wall[STAGES], cpu[STAGES];
+  long long render; /* wall time from image to text */
+  unsigned long cells, frames, bytes;
+  unsigned long exits; /* searches ended by a good enough cell */
+  unsigned long glyphs[GT];
+} stats_;
+
+/* What this thread has tallied since it last added them to stats_ */
+static __thread long long wall_[STAGES], cpu_[STAGES];
+static __thread unsigned long exits_;
+
+static long long Nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static long long CpuNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
 }
 
 /**
- * Determines dimensions of teletypewriter to default to full screen output
+ * Starts clock for lap(), if --stats was passed.
  */
-static void GetTermSize(unsigned *out_rows, unsigned *out_cols) {
-  struct winsize ws;
-  ws.ws_row = 24;
-  ws.ws_col = 80;
-  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1) {
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+static inline long long tick(void) {
+  return stats_.on ? Nanos() : 0;
+}
+
+/**
+ * Charges wall time since *t to stage and restarts the clock.
+ */
+static inline void lap(long long *t, unsigned stage) {
+  long long n;
+  if (stats_.on) {
+    n = Nanos();
+    wall_[stage] += n - *t;
+    *t = n;
   }
-  *out_rows = ws.ws_row;
-  *out_cols = ws.ws_col;
 }
 
-static void ReadAll(int fd, char *p, size_t n) {
-  ssize_t rc;
-  size_t got;
-  do {
-    ORDIE((rc = read(fd, p, n)) != -1);
-    got = rc;
-    if (!got && n) {
-      exit(EXIT_FAILURE);
-    }
-    p += got;
-    n -= got;
-  } while (n);
+struct Stopwatch {
+  long long wall, cpu;
+};
+
+static void StartStage(struct Stopwatch *w) {
+  w->wall = stats_.on ? Nanos() : 0;
+  w->cpu = stats_.on ? CpuNanos() : 0;
 }
 
-static unsigned char *LoadImageOrDie(char *path, unsigned yn, unsigned xn) {
-  void *rgb;
-  size_t size;
-  int pid, ws, rw[2];
-  char dim[10 + 1 + 10 + 1 + 1];
-  sprintf(dim, "%ux%u!", xn * XS, yn * YS);
-  pipe(rw);
-  if (!(pid = fork())) {
-    close(rw[0]);
-    dup2(rw[1], STDOUT_FILENO);
-    execlp("convert", "convert", path, "-resize", dim, "-colorspace", "RGB",
-           "-depth", "8", "rgb:-", NULL);
-    _exit(EXIT_FAILURE);
+/**
+ * Charges wall and CPU time since StartStage() to stage.
+ */
+static void StopStage(struct Stopwatch *w, unsigned stage) {
+  if (stats_.on) {
+    wall_[stage] += Nanos() - w->wall;
+    cpu_[stage] += CpuNanos() - w->cpu;
   }
-  close(rw[1]);
-  ORDIE((rgb = valloc((size = yn * YS * xn * XS * CN))));
-  ReadAll(rw[0], rgb, size);
-  ORDIE(close(rw[0]) != -1);
-  ORDIE(waitpid(pid, &ws, 0) != -1);
-  ORDIE(WEXITSTATUS(ws) == 0);
-  return rgb;
 }
 
-int main(int argc, char *argv[]) {
-  int i, j;
-  char *option, *filename;
-  void *rgb;
-  unsigned yd, xd;
-  int y=0, x=0;
+/**
+ * Adds what this thread tallied to stats_.
+ */
+static void FlushStats(void) {
+  unsigned i;
+  for (i = 0; i < STAGES; ++i) {
+    __atomic_fetch_add(stats_.wall + i, wall_[i], __ATOMIC_RELAXED);
+    __atomic_fetch_add(stats_.cpu + i, cpu_[i], __ATOMIC_RELAXED);
+    wall_[i] = cpu_[i] = 0;
+  }
+  __atomic_fetch_add(&stats_.exits, exits_, __ATOMIC_RELAXED);
+  exits_ = 0;
+}
 
-  btoa(0, 0); // FIXME: this is needed. But why?
+/* Adds n to stats_.x if --stats was passed, from whichever thread */
+#define TALLY(x, n) \
+  (stats_.on ? (void)__atomic_fetch_add(&stats_.x, n, __ATOMIC_RELAXED) \
+             : (void)0)
 
-  // Must provide at least one filename
-  if (argc < 2) {
-   printf (HELPTEXT);
-   exit (255);
-  }
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § blocks                                                     ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
 
-  // Dirty option parsing without getopt
-  for (i = 1; i < argc; ++i) {
-    option= argv[i]; // option=-y12
-    switch( (int) option[0] ) {
-       case '-': // unix style
-       case '/': // dos style
-           option++; // option=y12
-           switch( (int) option[0]) {
-                 case 'x':
-                    x = atoi(++option);
+struct Cell {
+  char32_t rune;
+  unsigned char bg[CN], fg[CN];
+};
+
+/**
+ * Serializes SGR parameters of background or foreground color.
+ *
+ * @param layer is '4' for background or '3' for foreground
+ * @param c is rgb, or the palette index followed by zeroes
+ * @param colors is 256 or 16 for palette indices, otherwise 0
+ */
+static char *colortoa(char *p, int layer, const unsigned char c[CN],
+                      unsigned colors) {
+  if (colors == 16) {
+    if (c[0] < 8) {
+      *p++ = layer;
+    } else if (layer == '4') {
+      *p++ = '1';
+      *p++ = '0';
+    } else {
+      *p++ = '9';
+    }
+    *p++ = '0' + (c[0] & 7);
+    return p;
+  }
+  *p++ = layer;
+  *p++ = '8';
+  *p++ = ';';
+  if (colors == 256) {
+    *p++ = '5';
+    *p++ = ';';
+    return btoa(p, c[0]);
+  }
+  *p++ = '2';
+  *p++ = ';';
+  p = btoa(p, c[0]);
+  *p++ = ';';
+  p = btoa(p, c[1]);
+  *p++ = ';';
+  return btoa(p, c[2]);
+}
+
+/**
+ * Serializes ANSI background, foreground, and UNICODE glyph to wire.
+ *
+ * Colors the terminal already has from the previous cell of the row are
+ * left out, and so are colors that can't be seen: the foreground of a
+ * space, and the background of a full block.
+ *
+ * @param last is what the terminal was last told, which gets updated,
+ *     or has rune 0 at the start of a row to send both colors
+ * @param colors is palette size, or 0 if the cell colors are rgb
+ */
+static char *celltoa(char *p, struct Cell cell, struct Cell *last,
+                     unsigned colors) {
+  int bg, fg;
+  if (last->rune) {
+    bg = cell.rune != u'█' && memcmp(cell.bg, last->bg, CN);
+    fg = cell.rune != u' ' && memcmp(cell.fg, last->fg, CN);
+  } else {
+    bg = fg = 1;
+  }
+  if (bg || fg) {
+    *p++ = 033;
+    *p++ = '[';
+    if (bg) {
+      p = colortoa(p, '4', cell.bg, colors);
+      memcpy(last->bg, cell.bg, CN);
+    }
+    if (bg && fg) {
+      *p++ = ';';
+    }
+    if (fg) {
+      p = colortoa(p, '3', cell.fg, colors);
+      memcpy(last->fg, cell.fg, CN);
+    }
+    *p++ = 'm';
+  }
+  last->rune = cell.rune;
+  p = tptoa(p, cell.rune);
+  return p;
+}
+
+/**
+ * Returns nonzero if cells look the same, ignoring invisible colors.
+ */
+static int samecell(struct Cell a, struct Cell b) {
+  return a.rune == b.rune &&
+         (a.rune == u'█' || !memcmp(a.bg, b.bg, CN)) &&
+         (a.rune == u' ' || !memcmp(a.fg, b.fg, CN));
+}
+
+/**
+ * Search effort of each MODE, which can be picked with -q at runtime.
+ */
+static const struct Tier {
+  const char *name;
+  unsigned pairs;  /* most (bg,fg) combos to consider */
+  unsigned glyphs; /* # of glyphs to consider */
+} kTiers[] = {
+    // FIXME: shouldn't best have all 44 glyphs?
+    [BEST] = {"best", 1u << MC, 35},
+    [FAST] = {"fast", 64, 35},
+    [FASTER] = {"faster", 16, 25},
+    [MEANS] = {"means", 0, 35},
+};
+
+#if MEMO
+/**
+ * Direct mapped cache of blocks that were already derasterized.
+ *
+ * Screenshots repeat the same blocks over and over, e.g. the flat
+ * backgrounds and the glyphs of a font, and video repeats them from one
+ * frame to the next. Each slot has a byte sized lock which is only ever
+ * tried, so threads that collide on a slot skip the cache rather than
+ * wait for each other.
+ */
+struct Memo {
+  unsigned char lock;
+  struct Cell cell; /* rune 0 if slot is empty */
+  unsigned char block[CN * BN];
+};
+#endif
+
+struct Render;
+
+/**
+ * Everything needed to render with one set of options.
+ *
+ * Contexts share nothing that changes, so each thread may render with
+ * its own at the same time. The tables are filled by pickglyphs(),
+ * initglyphs() and initsearch() when the context is made.
+ */
+struct derasterize {
+  int mode;
+  unsigned pairs;  /* most (bg,fg) combos to consider */
+  unsigned glyphs; /* # of glyphs picked into bits and picked */
+  FLOAT tolerance; /* good enough distance, 0 for exact search */
+  /* Squared deviation of blocks from their mean below which they're
+     FLAT or SMOOTH, 0 to search every block as hard as mode says */
+  FLOAT flat, smooth;
+  unsigned threads;
+  unsigned colors; /* palette size, or 0 for 24-bit color */
+  unsigned shortlist; /* glyphs scored per block, 0 for all, see search() */
+  /* Glyphs being considered, a subset of kShapes and kRunes in order */
+  glyph_t bits[GP];
+  char32_t picked[GP];
+  /* bits as a (BN × GP) matrix of ones where the glyph is foreground */
+  FLOAT masks[BN][GP] __attribute__((__aligned__(64)));
+  /* Number of foreground pixels in each glyph */
+  FLOAT counts[GP] __attribute__((__aligned__(64)));
+#if SIMD == 256
+  /* bits expanded into lane-blend masks, sign bit set where foreground */
+  __m256 blends[GP][BN / 8];
+#endif
+  /* Copies of the search made for the glyphs and effort picked, see
+     initsearch(), which take the block converted by rgb2lin() too, and
+     the colors its pixels can be painted with, see adapt() */
+  struct Cell (*derasterize)(const struct derasterize *,
+                             const unsigned char[CN * BN], const FLOAT[CN * BN],
+                             const FLOAT[CN * BN]);
+  struct Cell (*derasterizesmooth)(const struct derasterize *,
+                                   const unsigned char[CN * BN],
+                                   const FLOAT[CN * BN], const FLOAT[CN * BN]);
+  unsigned long efforts[3]; /* blocks by FLAT, SMOOTH, DETAILED */
+  unsigned long memohits, memomisses;
+  struct Render *render; /* kept around for the last size rendered */
+#if MEMO
+  struct Memo memo[1u << MEMO];
+#endif
+};
+
+/**
+ * Picks ≤pairs unique (bg,fg) pairs from product of lb.
+ *
+ * Only every CS-th pixel is a candidate, which on grids finer than 4×8
+ * keeps cells to as many pairs as on 4×8, spread over the whole cell
+ * rather than bunched up in its first rows. Candidates are numbered by
+ * the first one of the same color, and a bit matrix of CC×CC tells
+ * which numbers were paired already, so each background pixel gets the
+ * foreground pixels that make new pairs as a mask.
+ */
+static unsigned combinecolors(unsigned char bf[1u << MC][2],
+                              const unsigned char bl[CN * BN],
+                              unsigned pairs) {
+  unsigned i, j, n, b;
+  uint32_t m, w, u[CC], seen[CC];
+  int prev[CC], last[CC];
+  unsigned char id[CC];
+  for (i = 0; i < CC; ++i) {
+    b = i * CS;
+    u[i] = bl[2 * BN + b] << 020 | bl[1 * BN + b] << 010 | bl[0 * BN + b];
+    for (j = 0; u[j] != u[i]; ++j) {
+    }
+    id[i] = j;
+    prev[i] = j < i ? last[j] : -1;
+    last[j] = i;
+  }
+  memset(seen, 0, sizeof(seen));
+  for (n = i = 0; i < CC && n < pairs; ++i) {
+    // pixels after i whose color is new since i, and unpaired with its
+    for (m = w = j = 0; j < CC; ++j) {
+      if (j > i && prev[j] <= (int)i && !(seen[id[i]] >> id[j] & 1)) {
+        m |= 1u << j;
+        w |= 1u << id[j];
+      }
+    }
+    seen[id[i]] |= w;
+    for (; m && n < pairs; m &= m - 1) {
+      bf[n][0] = i * CS;
+      bf[n][1] = __builtin_ctz(m) * CS;
+      n++;
+    }
+  }
+  return n;
+}
+
+// The scoring kernels below must agree to the bit whatever their width,
+// so -Ofast isn't allowed to reassociate their sums behind our backs.
+#if defined(__clang__)
+#pragma float_control(precise, on, push)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("no-unsafe-math-optimizations")
+#endif
+
+// adjudicate() is only called by the scalar build and by bench.c
+#if (SCORE == PIXELS && !SIMD) || defined(BENCH)
+/**
+ * Computes distance between synthetic block and actual.
+ *
+ * The pixel errors are summed as rows of sixteen lanes, which are then
+ * folded in halves, which is the order the vector kernels of
+ * adjudicateall() use too, so that all of them agree to the bit.
+ *
+ * @param cl has the color pixel b and f get painted with, which is lb
+ *     itself unless they're quantized to a palette
+ */
+static FLOAT adjudicate(const struct derasterize *ctx, unsigned b, unsigned f,
+                        unsigned g, const FLOAT lb[CN * BN],
+                        const FLOAT cl[CN * BN]) {
+  unsigned i, j, k;
+  glyph_t gu;
+  FLOAT p[BN], q[BN], s[16], fu, bu;
+  memset(q, 0, sizeof(q));
+  for (k = 0; k < CN; ++k) {
+    gu = ctx->bits[g];
+    bu = cl[k * BN + b];
+    fu = cl[k * BN + f];
+    for (i = 0; i < BN; ++i) p[i] = (gu >> i & 1) ? fu : bu;
+    for (i = 0; i < BN; ++i) p[i] -= lb[k * BN + i];
+    // For a minimization problem, abs could do, but not faster in practice
+    for (i = 0; i < BN; ++i) q[i] += p[i] * p[i];
+  }
+  // sqrt(x) is strictly increasing in x
+  // so arg min sqrt(x) = arg min x
+  // so we can go faster by simply commenting out
+  // for (i = 0; i < BN; ++i) q[i] = SQRT(q[i]);
+  for (i = 0; i < 16; ++i) {
+    for (s[i] = q[i], j = 16; j < BN; j += 16) s[i] += q[j + i];
+  }
+  for (i = 0; i < 8; ++i) s[i] += s[i + 8];
+  for (i = 0; i < 4; ++i) s[i] += s[i + 4];
+  for (i = 0; i < 2; ++i) s[i] += s[i + 2];
+  return s[0] + s[1];
+}
+#endif
+
+#if SCORE == PIXELS || defined(BENCH)
+#if SIMD
+/**
+ * Adds eight lanes together, in the order adjudicate() does.
+ */
+static inline FLOAT hsum256(__m256 x) {
+  __m128 h;
+  h = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+  h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+  h = _mm_add_ss(h, _mm_movehdup_ps(h));
+  return _mm_cvtss_f32(h);
+}
+#endif
+
+/**
+ * Computes distance between synthetic block and actual for all glyphs.
+ *
+ * This does the same math as adjudicate() but only computes the error
+ * of the background and foreground colors once per pixel, and then
+ * just blends the two per glyph. On AVX-512 the glyph bitmask is used
+ * directly as 16-lane write masks; on AVX2 it's expanded by initglyphs()
+ * beforehand. Build with -DSIMD=0 to get the reference.
+ *
+ * @param gi has the indices of the gn glyphs to score, or NULL for all
+ */
+static void adjudicateall(const struct derasterize *ctx, FLOAT r[GP],
+                          unsigned b, unsigned f, const FLOAT lb[CN * BN],
+                          const FLOAT cl[CN * BN], unsigned gn,
+                          const unsigned short *gi) {
+#if SIMD == 512
+  unsigned g, h, i, k;
+  __m512 x, vb, vf, d, q, eb[BN / 16], ef[BN / 16];
+  for (i = 0; i < BN / 16; ++i) eb[i] = ef[i] = _mm512_setzero_ps();
+  for (k = 0; k < CN; ++k) {
+    vb = _mm512_set1_ps(cl[k * BN + b]);
+    vf = _mm512_set1_ps(cl[k * BN + f]);
+    for (i = 0; i < BN / 16; ++i) {
+      x = _mm512_loadu_ps(lb + k * BN + i * 16);
+      d = _mm512_sub_ps(vb, x), eb[i] = _mm512_fmadd_ps(d, d, eb[i]);
+      d = _mm512_sub_ps(vf, x), ef[i] = _mm512_fmadd_ps(d, d, ef[i]);
+    }
+  }
+  for (g = 0; g < gn; ++g) {
+    h = gi ? gi[g] : g;
+    q = _mm512_mask_blend_ps(ctx->bits[h], eb[0], ef[0]);
+    for (i = 1; i < BN / 16; ++i) {
+      q = _mm512_add_ps(
+          q, _mm512_mask_blend_ps(ctx->bits[h] >> (i * 16), eb[i], ef[i]));
+    }
+    r[g] = hsum256(_mm256_add_ps(_mm512_castps512_ps256(q),
+                                 _mm512_extractf32x8_ps(q, 1)));
+  }
+#elif SIMD == 256
+  unsigned g, h, i, k;
+  __m256 x, d, vb, vf, lo, hi, eb[BN / 8], ef[BN / 8];
+  for (i = 0; i < BN / 8; ++i) eb[i] = ef[i] = _mm256_setzero_ps();
+  for (k = 0; k < CN; ++k) {
+    vb = _mm256_set1_ps(cl[k * BN + b]);
+    vf = _mm256_set1_ps(cl[k * BN + f]);
+    for (i = 0; i < BN / 8; ++i) {
+      x = _mm256_loadu_ps(lb + k * BN + i * 8);
+      d = _mm256_sub_ps(vb, x), eb[i] = _mm256_fmadd_ps(d, d, eb[i]);
+      d = _mm256_sub_ps(vf, x), ef[i] = _mm256_fmadd_ps(d, d, ef[i]);
+    }
+  }
+  for (g = 0; g < gn; ++g) {
+    h = gi ? gi[g] : g;
+    lo = _mm256_blendv_ps(eb[0], ef[0], ctx->blends[h][0]);
+    hi = _mm256_blendv_ps(eb[1], ef[1], ctx->blends[h][1]);
+    for (i = 2; i < BN / 8; i += 2) {
+      lo = _mm256_add_ps(lo, _mm256_blendv_ps(eb[i], ef[i], ctx->blends[h][i]));
+      hi = _mm256_add_ps(
+          hi, _mm256_blendv_ps(eb[i + 1], ef[i + 1], ctx->blends[h][i + 1]));
+    }
+    r[g] = hsum256(_mm256_add_ps(lo, hi));
+  }
+#else
+  unsigned g;
+  for (g = 0; g < gn; ++g) r[g] = adjudicate(ctx, b, f, gi ? gi[g] : g, lb, cl);
+#endif
+}
+#endif /* SCORE == PIXELS || BENCH */
+
+#if defined(__clang__)
+#pragma float_control(pop)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+/**
+ * Picks glyphs to consider, e.g. for fonts lacking the box drawings.
+ *
+ * Glyphs that look the same on the grid as one picked before them are
+ * left out, since they can only ever tie.
+ *
+ * @param s is a count of leading kRunes, the runes themselves, or
+ *     NULL for as many as kTiers[ctx->mode] says
+ * @return 0 on success, or -1 if a rune isn't one of kRunes
+ */
+static int pickglyphs(struct derasterize *ctx, const char *s) {
+  char32_t c;
+  unsigned g, h, n, m;
+  unsigned char want[GT];
+  memset(want, 0, sizeof(want));
+  if (!s || ('0' <= *s && *s <= '9')) {
+    n = s ? (unsigned)MIN(MAX(1, atoi(s)), (int)GT)
+          : kTiers[ctx->mode].glyphs;
+    memset(want, 1, n);
+  } else {
+    for (; *s; want[g] = 1) {
+      c = *s++ & 0xff;
+      if (c >= 0xc0) {
+        for (m = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1, c &= 0x3f >> m; m--; ++s) {
+          // which also stops at the end of a truncated sequence
+          if ((*s & 0xc0) != 0x80) return -1;
+          c = c << 6 | (*s & 0x3f);
+        }
+      }
+      for (g = 0; g < GT && kRunes[g] != c; ++g) {
+      }
+      if (g == GT) return -1;
+    }
+  }
+  for (ctx->glyphs = g = 0; g < GT; ++g) {
+    if (!want[g]) continue;
+    for (h = 0; h < ctx->glyphs && ctx->bits[h] != kShapes[g]; ++h) {
+    }
+    if (h < ctx->glyphs) continue;
+    ctx->bits[ctx->glyphs] = kShapes[g];
+    ctx->picked[ctx->glyphs++] = kRunes[g];
+  }
+  return 0;
+}
+
+/**
+ * Expands bits into the tables needed by the scoring kernels.
+ *
+ * Counts are stored rather than added up, so it can be called again.
+ * @note call initglyphs() after pickglyphs()
+ */
+static void initglyphs(struct derasterize *ctx) {
+  unsigned g, i;
+#if SIMD == 256
+  unsigned j;
+  int32_t m[8];
+#endif
+  for (g = 0; g < ctx->glyphs; ++g) {
+    for (ctx->counts[g] = i = 0; i < BN; ++i) {
+      ctx->masks[i][g] = ctx->bits[g] >> i & 1;
+      ctx->counts[g] += ctx->masks[i][g];
+    }
+  }
+#if SIMD == 256
+  for (g = 0; g < ctx->glyphs; ++g) {
+    for (i = 0; i < BN / 8; ++i) {
+      for (j = 0; j < 8; ++j) {
+        m[j] = ctx->bits[g] >> (i * 8 + j) & 1 ? -1 : 0;
+      }
+      ctx->blends[g][i] = _mm256_castsi256_ps(_mm256_loadu_si256((void *)m));
+    }
+  }
+#endif
+}
+
+/*
+ * The functions below take the number of glyph lanes gp, rounded up to
+ * whole vectors, and the number of color pairs as parameters, so that
+ * they get inlined into copies of derasterize() where they're constant
+ * and the loops can be unrolled.
+ */
+#define forceinline static inline __attribute__((__always_inline__))
+#define unused __attribute__((__unused__)) /* by some copies or builds */
+
+/**
+ * Sums the linear pixels covered by each glyph, per channel.
+ *
+ * This is the (gp × BN)·(BN × CN) product of the glyph masks and the
+ * block. It's all adjudicatemoments() needs to know about the glyphs.
+ */
+forceinline void moments(const struct derasterize *ctx, FLOAT sg[CN][GP],
+                         const FLOAT lb[CN * BN], unsigned gp) {
+  unsigned i, j, k, g;
+  FLOAT a[CN][16];
+  // sixteen glyphs at a time, so the sums stay in registers, and all
+  // channels at once, so they don't wait on each other's additions
+  for (g = 0; g < gp; g += 16) {
+    memset(a, 0, sizeof(a));
+    for (i = 0; i < BN; ++i) {
+      for (k = 0; k < CN; ++k) {
+        for (j = 0; j < 16; ++j) {
+          a[k][j] += ctx->masks[i][g + j] * lb[k * BN + i];
+        }
+      }
+    }
+    for (k = 0; k < CN; ++k) memcpy(sg[k] + g, a[k], sizeof(a[k]));
+  }
+}
+
+/**
+ * Computes distance between actual block and each of its candidate
+ * pixel colors, as painted, over the whole block.
+ *
+ * @param e receives errors by candidate, i.e. pixel index / CS
+ */
+static void flaterrors(FLOAT e[CC], const FLOAT lb[CN * BN],
+                       const FLOAT cl[CN * BN]) {
+  unsigned i, j, k;
+  FLOAT c[CN][CC];
+  for (k = 0; k < CN; ++k) {
+    for (j = 0; j < CC; ++j) c[k][j] = cl[k * BN + j * CS];
+  }
+  memset(e, 0, CC * sizeof(FLOAT));
+  for (k = 0; k < CN; ++k) {
+    for (i = 0; i < BN; ++i) {
+      for (j = 0; j < CC; ++j) {
+        e[j] += SQR(c[k][j] - lb[k * BN + i]);
+      }
+    }
+  }
+}
+
+/**
+ * Computes distance between synthetic block and actual for all glyphs.
+ *
+ * Expanding the squared error of glyph g with colors b and f gives
+ *
+ *   Σᵢ‖b−xᵢ‖² + |g|·(‖f‖²−‖b‖²) − 2·(f−b)·Σ_{i∈g} xᵢ
+ *
+ * where the first term is e[b/CS] and the sum is sg[·][g], so each glyph
+ * costs CN+1 multiply-adds no matter how many pixels it has. It isn't
+ * bit-identical to adjudicate(), but is exactly zero for flat blocks, so
+ * it's only used when built with -DSCORE=MOMENTS.
+ */
+forceinline void adjudicatemoments(const FLOAT counts[GP], FLOAT r[GP],
+                                   unsigned b, unsigned f,
+                                   const FLOAT cl[CN * BN], const FLOAT e[CC],
+                                   const FLOAT sg[CN][GP], unsigned gp) {
+  unsigned g, k;
+  FLOAT c, bu, fu, w[CN];
+  c = 0;
+  for (k = 0; k < CN; ++k) {
+    bu = cl[k * BN + b];
+    fu = cl[k * BN + f];
+    c += (fu - bu) * (fu + bu);
+    w[k] = -2 * (fu - bu);
+  }
+  for (g = 0; g < gp; ++g) {
+    r[g] = e[b / CS] + counts[g] * c + w[0] * sg[0][g] + w[1] * sg[1][g] +
+           w[2] * sg[2][g];
+  }
+}
+
+/**
+ * Converts tiny bitmap graphic into unicode glyph, solving for colors.
+ *
+ * The colors minimizing the squared error of a glyph are the means of
+ * the pixels on either side of its mask. Splitting the block variance,
+ * the residual is smallest where the between-class term
+ *
+ *   ‖BN·Σ_{i∈g} xᵢ − |g|·Σᵢ xᵢ‖² / (BN·|g|·(BN−|g|))
+ *
+ * is largest, which takes one pass over the moments of the glyphs
+ * instead of scoring pixel pairs against each of them.
+ */
+forceinline struct Cell fit(const struct derasterize *ctx,
+                            const FLOAT lb[CN * BN], unsigned gp) {
+  struct Cell cell;
+  unsigned i, k, g, n, best;
+  long long t0;
+  FLOAT t, w, d, s[CN], mb[CN], mf[CN], sg[CN][GP], gain[GP];
+  t0 = tick();
+  moments(ctx, sg, lb, gp);
+  for (k = 0; k < CN; ++k) {
+    for (s[k] = i = 0; i < BN; ++i) s[k] += lb[k * BN + i];
+  }
+  for (g = 0; g < gp; ++g) {
+    n = ctx->counts[g];
+    w = n && n < BN ? 1 / (FLOAT)(BN * n * (BN - n)) : 0;
+    for (t = k = 0; k < CN; ++k) {
+      d = BN * sg[k][g] - ctx->counts[g] * s[k];
+      t += d * d;
+    }
+    gain[g] = w * t;
+  }
+  for (best = 0, g = 1; g < ctx->glyphs; ++g) {
+    if (gain[g] > gain[best]) best = g;
+  }
+  n = ctx->counts[best];
+  for (k = 0; k < CN; ++k) {
+    mb[k] = n < BN ? (s[k] - sg[k][best]) / (BN - n) : s[k] / BN;
+    mf[k] = n ? sg[k][best] / n : s[k] / BN;
+  }
+  paint(cell.bg, ctx->colors, mb);
+  paint(cell.fg, ctx->colors, mf);
+  // a glyph whose colors round to the same bytes is drawn as a space
+  cell.rune = memcmp(cell.bg, cell.fg, CN) ? ctx->picked[best] : u' ';
+  lap(&t0, SCORING);
+  return cell;
+}
+
+/**
+ * Computes squared distance between the colors of every candidate pixel
+ * as painted, see combinecolors(), and every pixel.
+ */
+static void distances(FLOAT d[CC][BN], const FLOAT lb[CN * BN],
+                      const FLOAT cl[CN * BN]) {
+  unsigned i, j, b;
+  for (j = 0; j < CC; ++j) {
+    b = j * CS;
+    for (i = 0; i < BN; ++i) {
+      d[j][i] = SQR(cl[0 * BN + b] - lb[0 * BN + i]) +
+                SQR(cl[1 * BN + b] - lb[1 * BN + i]) +
+                SQR(cl[2 * BN + b] - lb[2 * BN + i]);
+    }
+  }
+}
+
+/**
+ * Computes lower bound on distance for each pair, whatever the glyph.
+ *
+ * Every pixel costs at least the distance to the nearer of the two
+ * colors, so no glyph can do better than the mask that would put each
+ * pixel on its nearer side. That's a few vector ops per pair instead of
+ * scoring all the glyphs. The bound is lowered by a margin, comfortably
+ * larger than the rounding of the kernels, so pruning with it can never
+ * skip what the exhaustive search would have picked.
+ *
+ * @return index of pair with lowest bound
+ */
+static unsigned bounds(FLOAT lo[1u << MC], unsigned char bf[1u << MC][2],
+                       unsigned n, const FLOAT d[CC][BN], const FLOAT e[CC]) {
+  FLOAT t, m;
+  unsigned i, j, s;
+  const FLOAT *db, *df;
+  for (m = j = 0; j < CC; ++j) m = MAX(m, e[j]);
+  m = FLOAT_C(1e-3) * (1 + m);
+  for (s = i = 0; i < n; ++i) {
+    db = d[bf[i][0] / CS];
+    df = d[bf[i][1] / CS];
+    for (t = j = 0; j < BN; ++j) t += MIN(db[j], df[j]);
+    lo[i] = t - m;
+    if (lo[i] < lo[s]) s = i;
+  }
+  return s;
+}
+
+/**
+ * Returns mask of pixels nearer to the color of pixel f than of b.
+ */
+static glyph_t shapeof(const FLOAT lb[CN * BN], const FLOAT cl[CN * BN],
+                       unsigned b, unsigned f) {
+  unsigned i, k;
+  glyph_t m;
+  FLOAT db, df;
+  for (m = i = 0; i < BN; ++i) {
+    for (db = df = k = 0; k < CN; ++k) {
+      db += SQR(cl[k * BN + b] - lb[k * BN + i]);
+      df += SQR(cl[k * BN + f] - lb[k * BN + i]);
+    }
+    m |= (glyph_t)(df < db) << i;
+  }
+  return m;
+}
+
+static inline unsigned popcount(glyph_t x) {
+#if BN > 64
+  return __builtin_popcountll(x) + __builtin_popcountll(x >> 64);
+#else
+  return __builtin_popcountll(x);
+#endif
+}
+
+/**
+ * Picks the ctx->shortlist glyphs whose shape is nearest to mask m.
+ *
+ * Shapes are ranked by the number of pixels they differ in, counting
+ * each glyph inverted too, since other pairs than the one m was made
+ * from can have its two colors the other way round. Ties are broken in
+ * the order glyphs were picked, so it's the same list on every machine.
+ *
+ * @return # of glyph indices written to gi, in ascending order
+ */
+static unsigned rankglyphs(const struct derasterize *ctx,
+                           unsigned short gi[GP], glyph_t m, unsigned gn) {
+  unsigned g, n, t, k, h[GP], c[BN / 2 + 1];
+  memset(c, 0, sizeof(c));
+  for (g = 0; g < gn; ++g) {
+    n = popcount(m ^ ctx->bits[g]);
+    h[g] = MIN(n, BN - n);
+    ++c[h[g]];
+  }
+  // all glyphs nearer than t make the list, and the rest are tied at t
+  for (n = t = 0; n + c[t] < ctx->shortlist; ++t) n += c[t];
+  for (n = ctx->shortlist - n, k = g = 0; g < gn; ++g) {
+    if (h[g] < t) {
+      gi[k++] = g;
+    } else if (h[g] == t && n) {
+      gi[k++] = g;
+      --n;
+    }
+  }
+  return k;
+}
+
+/**
+ * Converts tiny bitmap graphic into unicode glyph.
+ *
+ * This is a branch-and-bound search over the color pairs. The pair with
+ * the lowest bound is scored first, and the best of its glyphs becomes
+ * a threshold which other pairs must be able to beat to get scored at
+ * all, along with the best found so far. Pairs are otherwise visited in
+ * order, so the cell picked is the same the exhaustive search picks,
+ * unless the tolerance lets it settle for one that's good enough.
+ *
+ * With a shortlist, only the glyphs whose shape is nearest to how the
+ * pair with the lowest bound would split the block get scored at all,
+ * see rankglyphs(), which trades exactness for a smaller inner loop.
+ *
+ * @param block has the colors cells get, as rgb or palette indices
+ * @param cl has them in linear light, to be scored against lb
+ * @param pairs is most color combos to consider, or 0 for ctx->pairs
+ * @param gn is # of glyphs to consider, or 0 for ctx->glyphs
+ */
+forceinline struct Cell search(const struct derasterize *ctx,
+                               const unsigned char block[CN * BN],
+                               const FLOAT lb[CN * BN], const FLOAT cl[CN * BN],
+                               unsigned gp, unsigned pairs, unsigned gn,
+                               int shortlist) {
+  long long t0;
+  struct Cell cell;
+  FLOAT t, t2, best, r[GP], rs[GP], e[CC];
+  FLOAT lo[1u << MC], d[CC][BN];
+  unsigned i, n, s, b, f, g;
+  unsigned char bf[1u << MC][2];
+  unsigned short gi[GP];
+  const char32_t *runes;
+  char32_t rk[GP];
+#if SCORE == MOMENTS
+  FLOAT sg[CN][GP], sk[CN][GP], ck[GP];
+  const FLOAT(*sp)[GP], *counts;
+#else
+  const unsigned short *gs = 0;
+#endif
+  if (!gn) gn = ctx->glyphs;
+  t0 = tick();
+  n = combinecolors(bf, block, pairs ? pairs : ctx->pairs);
+#if SCORE == MOMENTS
+  moments(ctx, sg, lb, gp);
+  sp = sg;
+  counts = ctx->counts;
+#endif
+  flaterrors(e, lb, cl);
+  // bounding costs about as much as scoring a dozen pairs
+  if (n > 16) {
+    distances(d, lb, cl);
+    s = bounds(lo, bf, n, d, e);
+  } else {
+    for (i = 0; i < n; ++i) lo[i] = -1;
+    s = n;
+  }
+  runes = ctx->picked;
+  if (shortlist) {
+    i = s < n ? s : 0;
+    gn = rankglyphs(ctx, gi, shapeof(lb, cl, bf[i][0], bf[i][1]), gn);
+    gp = (gn + 15) & -16u;
+    for (g = gn; g < gp; ++g) gi[g] = gi[0];
+    for (g = 0; g < gp; ++g) rk[g] = ctx->picked[gi[g]];
+#if SCORE == MOMENTS
+    for (g = 0; g < gp; ++g) {
+      ck[g] = ctx->counts[gi[g]];
+      sk[0][g] = sg[0][gi[g]];
+      sk[1][g] = sg[1][gi[g]];
+      sk[2][g] = sg[2][gi[g]];
+    }
+    sp = sk;
+    counts = ck;
+#else
+    gs = gi;
+#endif
+    runes = rk;
+  }
+  lap(&t0, PAIRING);
+  if (s < n) {
+#if SCORE == MOMENTS
+    adjudicatemoments(counts, rs, bf[s][0], bf[s][1], cl, e, sp, gp);
+#else
+    adjudicateall(ctx, rs, bf[s][0], bf[s][1], lb, cl, gn, gs);
+#endif
+    for (t = rs[0], g = 1; g < gn; ++g) t = MIN(t, rs[g]);
+    t = MAX(t, 0);
+  } else {
+    t = 0;
+  }
+  best = -1u;
+  cell.rune = 0;
+  for (i = 0; i < n; ++i) {
+    if (lo[i] > MIN(t, best)) continue;
+    b = bf[i][0];
+    f = bf[i][1];
+    if (i == s) {
+      memcpy(r, rs, sizeof(r));
+    } else {
+#if SCORE == MOMENTS
+      adjudicatemoments(counts, r, b, f, cl, e, sp, gp);
+#else
+      adjudicateall(ctx, r, b, f, lb, cl, gn, gs);
+#endif
+    }
+    for (t2 = r[0], g = 1; g < gn; ++g) t2 = MIN(t2, r[g]);
+    if (t2 >= best) continue;
+    for (g = 0; g < gn; ++g) {
+      if (r[g] < best) {
+        best = r[g];
+        cell.rune = runes[g];
+        cell.bg[0] = block[0 * BN + b];
+        cell.bg[1] = block[1 * BN + b];
+        cell.bg[2] = block[2 * BN + b];
+        cell.fg[0] = block[0 * BN + f];
+        cell.fg[1] = block[1 * BN + f];
+        cell.fg[2] = block[2 * BN + f];
+        if (ctx->tolerance ? best <= ctx->tolerance : !best) {
+          ++exits_;
+          lap(&t0, SCORING);
+          return cell;
+        }
+      }
+    }
+  }
+  lap(&t0, SCORING);
+  return cell;
+}
+
+#define SEARCH(GW, PAIRS)                                               \
+  static struct Cell search##GW##x##PAIRS(const struct derasterize *ctx, \
+                                          const unsigned char *block,    \
+                                          const FLOAT *lb,               \
+                                          const FLOAT *cl) {             \
+    return search(ctx, block, lb, cl, GW, PAIRS, 0, 0);                  \
+  }
+#define FIT(GW)                                                        \
+  static struct Cell fit##GW(const struct derasterize *ctx,            \
+                             const unsigned char *block unused,        \
+                             const FLOAT *lb, const FLOAT *cl unused) { \
+    return fit(ctx, lb, GW);                                           \
+  }
+SEARCH(48, 512)
+SEARCH(48, 64)
+SEARCH(32, 16)
+SEARCH(16, 16)
+SEARCH(16, 0)
+SEARCH(32, 0)
+SEARCH(48, 0)
+FIT(16)
+FIT(32)
+FIT(48)
+
+static struct Cell searchsmooth(const struct derasterize *ctx,
+                                const unsigned char *block, const FLOAT *lb,
+                                const FLOAT *cl) {
+  return search(ctx, block, lb, cl, 32, 16, 25, 0);
+}
+
+/* Copies for more glyphs than 48, e.g. the sextants and braille, whose
+   loops run over as many vectors of glyphs as picked */
+static struct Cell searchmany(const struct derasterize *ctx,
+                              const unsigned char *block, const FLOAT *lb,
+                              const FLOAT *cl) {
+  return search(ctx, block, lb, cl, (ctx->glyphs + 15) & -16u, 0, 0, 0);
+}
+static struct Cell searchshort(const struct derasterize *ctx,
+                               const unsigned char *block, const FLOAT *lb,
+                               const FLOAT *cl) {
+  return search(ctx, block, lb, cl, (ctx->glyphs + 15) & -16u, 0, 0, 1);
+}
+static struct Cell fitmany(const struct derasterize *ctx,
+                           const unsigned char *block unused, const FLOAT *lb,
+                           const FLOAT *cl unused) {
+  return fit(ctx, lb, (ctx->glyphs + 15) & -16u);
+}
+
+/**
+ * Chooses copies of the search for the glyphs and effort picked.
+ * @note call initsearch() once after initglyphs()
+ */
+static void initsearch(struct derasterize *ctx) {
+  unsigned i, gp;
+  static const struct Search {
+    unsigned gp, pairs; /* pairs 0 means any */
+    struct Cell (*f)(const struct derasterize *, const unsigned char *,
+                     const FLOAT *, const FLOAT *);
+  } kSearches[] = {
+      {48, 512, search48x512}, {48, 64, search48x64}, {32, 16, search32x16},
+      {16, 0, search16x0},     {32, 0, search32x0},   {48, 0, search48x0},
+  };
+  static struct Cell (*const kFits[3])(const struct derasterize *,
+                                      const unsigned char *, const FLOAT *,
+                                      const FLOAT *) = {
+      fit16,
+      fit32,
+      fit48,
+  };
+  if (!ctx->pairs) ctx->pairs = kTiers[ctx->mode].pairs;
+  ctx->pairs = MIN(ctx->pairs, 1u << MC);
+  gp = (ctx->glyphs + 15) & -16u;
+  if (ctx->glyphs > 25) {
+    ctx->derasterizesmooth = searchsmooth;
+  } else {
+    ctx->derasterizesmooth = gp == 16 ? search16x16 : search32x16;
+  }
+  if (ctx->mode == MEANS) {
+    ctx->derasterize = ctx->derasterizesmooth =
+        gp <= 48 ? kFits[gp / 16 - 1] : fitmany;
+  } else if (ctx->shortlist && ctx->shortlist < ctx->glyphs) {
+    ctx->derasterize = searchshort;
+  } else if (gp > 48) {
+    ctx->derasterize = searchmany;
+  } else {
+    for (i = 0; i < ARRAYLEN(kSearches); ++i) {
+      if (kSearches[i].gp == gp &&
+          (!kSearches[i].pairs || kSearches[i].pairs == ctx->pairs)) {
+        ctx->derasterize = kSearches[i].f;
+        break;
+      }
+    }
+  }
+}
+
+#define FLAT 0     /* painted as a space of the mean color */
+#define SMOOTH 1   /* searched on a budget */
+#define DETAILED 2 /* searched as hard as -q says */
+
+/**
+ * Counts how the blocks of a row were turned into cells.
+ */
+struct Tally {
+  unsigned hits;       /* found in memo */
+  unsigned efforts[3]; /* by FLAT, SMOOTH, DETAILED */
+};
+
+/**
+ * Converts tiny bitmap graphic into unicode glyph, with an effort that
+ * depends on how much detail the block has.
+ *
+ * The squared deviation of the block from its mean color in linear
+ * light is the error of painting it flat, so below ctx->flat it's simply
+ * painted flat. Blocks that are merely smooth don't have the contrast
+ * for a wide search over pairs and glyphs to find much, so they only
+ * get the budget of FASTER. Blocks that get searched are quantized to
+ * the palette first, if there is one.
+ */
+static struct Cell adapt(const struct derasterize *ctx,
+                         unsigned char block[CN * BN], struct Tally *t) {
+  unsigned i, k, e;
+  struct Cell cell;
+  long long t0;
+  const FLOAT *cl;
+  unsigned char *pb, qb[CN * BN];
+  FLOAT x, v, s[CN], q[CN], lb[CN * BN], ql[CN * BN];
+  t0 = tick();
+  rgb2lin(lb, block);
+  lap(&t0, LINEARIZING);
+  e = DETAILED;
+  if (ctx->flat || ctx->smooth) {
+    for (v = k = 0; k < CN; ++k) {
+      for (s[k] = q[k] = i = 0; i < BN; ++i) {
+        x = lb[k * BN + i];
+        s[k] += x;
+        q[k] += x * x;
+      }
+      v += q[k] - s[k] * s[k] / BN;
+    }
+    if (v <= ctx->flat) {
+      t->efforts[FLAT]++;
+      cell.rune = u' ';
+      for (k = 0; k < CN; ++k) s[k] /= BN;
+      paint(cell.bg, ctx->colors, s);
+      memcpy(cell.fg, cell.bg, CN);
+      return cell;
+    } else if (v <= ctx->smooth) {
+      e = SMOOTH;
+    }
+  }
+  t->efforts[e]++;
+  if (ctx->colors) {
+    quantizeblock(qb, ql, block, ctx->colors);
+    lap(&t0, LINEARIZING);
+    pb = qb;
+    cl = ql;
+  } else {
+    pb = block;
+    cl = lb;
+  }
+  if (e == SMOOTH) {
+    return ctx->derasterizesmooth(ctx, pb, lb, cl);
+  } else {
+    return ctx->derasterize(ctx, pb, lb, cl);
+  }
+}
+
+#if MEMO
+static unsigned hashblock(const unsigned char block[CN * BN]) {
+  unsigned i;
+  uint64_t h, w;
+  for (h = i = 0; i < CN * BN; i += 8) {
+    memcpy(&w, block + i, 8);
+    h = (h ^ w) * 0x9E3779B97F4A7C15u;
+    h ^= h >> 29;
+  }
+  return h >> (64 - MEMO);
+}
+
+/**
+ * Converts tiny bitmap graphic into unicode glyph, unless it already
+ * was, which is the same cell since adapt() is deterministic.
+ */
+static struct Cell memoize(struct derasterize *ctx,
+                           unsigned char block[CN * BN], struct Tally *t) {
+  struct Cell cell;
+  struct Memo *m;
+  m = ctx->memo + hashblock(block);
+  if (!__atomic_test_and_set(&m->lock, __ATOMIC_ACQUIRE)) {
+    if (m->cell.rune && !memcmp(m->block, block, CN * BN)) {
+      cell = m->cell;
+      __atomic_clear(&m->lock, __ATOMIC_RELEASE);
+      t->hits++;
+      return cell;
+    }
+    __atomic_clear(&m->lock, __ATOMIC_RELEASE);
+  }
+  cell = adapt(ctx, block, t);
+  if (!__atomic_test_and_set(&m->lock, __ATOMIC_ACQUIRE)) {
+    m->cell = cell;
+    memcpy(m->block, block, CN * BN);
+    __atomic_clear(&m->lock, __ATOMIC_RELEASE);
+  }
+  return cell;
+}
+#endif
+
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § graphics                                                   ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+/**
+ * Upper bound on bytes emitted for one row of cells, including CRLF.
+ * The per cell bound has enough room to spare for the cursor position
+ * and synchronized update marker that lead a differential row.
+ */
+#define ROWMAX(xn) ((xn) * (32 + (2 + (1 + 3) * 3) * 2 + 1 + 4) + 2)
+
+#define RINGMAX 64 /* most rows streamed output may have in flight */
+
+/**
+ * Renderer for images of a given size, with buffers and thread pool
+ * that are kept around so playing video doesn't allocate per frame.
+ */
+struct Render {
+  struct derasterize *ctx;
+  unsigned yn, xn;
+  unsigned slots; /* rows of storage, yn unless streaming through a ring */
+  size_t cap;   /* ROWMAX(xn) */
+  char *vt;     /* slots slices of cap bytes, stitched in place */
+  size_t *len;  /* bytes rendered into each slice */
+  char *ready;  /* slice holds a row that's yet to be flushed */
+  unsigned flushed; /* rows handed to the writer, when streaming */
+  struct Cell *cell, *prev; /* slots*xn grids being rendered and on screen */
+  int diff;     /* only emit cells that changed from prev */
+  int stream;   /* rows are flushed in order through RenderStream() */
+  int drawn;    /* prev holds what the terminal shows */
+  const unsigned char *rgb;
+  size_t stride; /* bytes per row of pixels in rgb */
+  unsigned char (*tile)[CN * BN]; /* slots*xn blocks cut from rgb */
+  unsigned y;    /* next row of cells to claim */
+  unsigned gen;  /* bumped to hand the pool a new image */
+  unsigned busy; /* workers not done with current image */
+  unsigned n;    /* threads, counting the caller */
+  int quit;
+  pthread_t *th;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, idle;
+  pthread_cond_t done, room; /* a row got rendered, a slice got flushed */
+};
+
+/**
+ * Cuts one row of packed 8-bit RGB cells into blocks.
+ *
+ * Each block is stored the way derasterize() reads it, one plane of BN
+ * bytes per channel. On x86 the four pixels of each block row are
+ * split into channels with a byte shuffle, and four rows at a time are
+ * transposed as 32-bit lanes, so a plane is written sixteen bytes at a
+ * time. Build with -DSIMD=0 to get the reference.
+ */
+static void tilecells(unsigned char (*tile)[CN * BN], const unsigned char *rgb,
+                      unsigned xn, size_t w) {
+  unsigned x, i;
+#if SIMD && XS == 4 && YS % 4 == 0
+  int v;
+  unsigned h;
+  const unsigned char *p;
+  __m128i a[4], t0, t1, t2, t3, m;
+  m = _mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1);
+  for (x = 0; x < xn; ++x) {
+    for (h = 0; h < YS; h += 4) {
+      for (i = 0; i < 4; ++i) {
+        // twelve bytes exactly, since the last block ends the image
+        p = rgb + (h + i) * w + x * XS * CN;
+        memcpy(&v, p + 8, 4);
+        a[i] = _mm_insert_epi32(_mm_loadl_epi64((const __m128i *)p), v, 2);
+        a[i] = _mm_shuffle_epi8(a[i], m);
+      }
+      t0 = _mm_unpacklo_epi32(a[0], a[1]);
+      t1 = _mm_unpacklo_epi32(a[2], a[3]);
+      t2 = _mm_unpackhi_epi32(a[0], a[1]);
+      t3 = _mm_unpackhi_epi32(a[2], a[3]);
+      _mm_storeu_si128((__m128i *)(tile[x] + 0 * BN + h * XS),
+                       _mm_unpacklo_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(tile[x] + 1 * BN + h * XS),
+                       _mm_unpackhi_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(tile[x] + 2 * BN + h * XS),
+                       _mm_unpacklo_epi64(t2, t3));
+    }
+  }
+#else
+  unsigned j, k;
+  const unsigned char *rows[YS];
+  for (i = 0; i < YS; ++i) {
+    rows[i] = rgb + i * w - XS * CN;
+  }
+  for (x = 0; x < xn; ++x) {
+    for (i = 0; i < YS; ++i) {
+      rows[i] += XS * CN;
+      for (j = 0; j < XS; ++j) {
+        for (k = 0; k < CN; ++k) {
+          tile[x][(k * YS + i) * XS + j] = rows[i][j * CN + k];
+        }
+      }
+    }
+  }
+#endif
+}
+
+/**
+ * Turns one row of blocks into cells.
+ */
+static void RenderCells(struct derasterize *ctx, struct Cell *c,
+                        unsigned char (*tile)[CN * BN], unsigned xn) {
+  unsigned x, i, g;
+  struct Tally t = {0};
+  unsigned long h[GT];
+  for (x = 0; x < xn; ++x) {
+#if MEMO
+    c[x] = memoize(ctx, tile[x], &t);
+#else
+    c[x] = adapt(ctx, tile[x], &t);
+#endif
+  }
+#if MEMO
+  __atomic_fetch_add(&ctx->memohits, t.hits, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ctx->memomisses, xn - t.hits, __ATOMIC_RELAXED);
+#endif
+  for (i = 0; i < 3; ++i) {
+    __atomic_fetch_add(ctx->efforts + i, t.efforts[i], __ATOMIC_RELAXED);
+  }
+  if (stats_.on) {
+    memset(h, 0, sizeof(h));
+    for (x = 0; x < xn; ++x) {
+      for (g = 0; g < GT - 1 && kRunes[g] != c[x].rune; ++g) {
+      }
+      h[g]++;
+    }
+    for (g = 0; g < GT; ++g) {
+      if (h[g]) __atomic_fetch_add(stats_.glyphs + g, h[g], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Turns one row of cells into ANSI UNICODE text.
+ */
+static char *FormatRow(char *v, const struct Cell *c, unsigned xn,
+                       unsigned colors) {
+  unsigned x;
+  struct Cell c1;
+  c1.rune = 0;
+  for (x = 0; x < xn; ++x) {
+    v = celltoa(v, c[x], &c1, colors);
+  }
+  return v;
+}
+
+/**
+ * Turns one row of cells into ANSI UNICODE text that redraws only the
+ * cells which differ from what the terminal shows.
+ *
+ * The first changed cell is reached with an absolute cursor position.
+ * Unchanged cells between two changes are either sent again or jumped
+ * over with a cursor forward, whichever takes fewer bytes. SGR state
+ * survives cursor motion, so colors stay delta encoded along the row.
+ *
+ * @param p is row on screen, or NULL if unknown
+ * @return v unchanged if nothing needs to be redrawn
+ */
+static char *FormatDiff(char *v, const struct Cell *c, const struct Cell *p,
+                        unsigned xn, unsigned y, unsigned colors) {
+  char *s, m[16];
+  unsigned x, j, k;
+  struct Cell c1, t;
+  c1.rune = 0;
+  for (x = 0; x < xn;) {
+    if (p && samecell(c[x], p[x])) {
+      for (k = x + 1; k < xn && samecell(c[k], p[k]); ++k) {
+      }
+      if (k == xn) break;
+      if (c1.rune) {
+        s = v;
+        t = c1;
+        for (j = x; j < k; ++j) v = celltoa(v, c[j], &c1, colors);
+        if (v - s > cuftoa(m, k - x) - m) {
+          v = cuftoa(s, k - x);
+          c1 = t;
+        }
+      }
+      x = k;
+      continue;
+    }
+    if (!c1.rune) v = cuptoa(v, y, x);
+    v = celltoa(v, c[x++], &c1, colors);
+  }
+  return v;
+}
+
+/**
+ * Renders rows of cells until none are left unclaimed.
+ *
+ * Rows are handed out one at a time from a shared cursor, so a worker
+ * stuck on a detailed row doesn't hold back the others while they race
+ * through flat ones that hit the early exit in derasterize().
+ */
+static void RenderRow(struct Render *r, unsigned y) {
+  char *v, *e;
+  unsigned i;
+  struct Cell *c;
+  struct Stopwatch w;
+  i = y % r->slots;
+  v = r->vt + i * r->cap;
+  c = r->cell + i * r->xn;
+  StartStage(&w);
+  tilecells(r->tile + i * r->xn, r->rgb + y * YS * r->stride, r->xn,
+            r->stride);
+  StopStage(&w, TILING);
+  StartStage(&w);
+  RenderCells(r->ctx, c, r->tile + i * r->xn, r->xn);
+  StopStage(&w, MATCHING);
+  StartStage(&w);
+  if (r->diff) {
+    e = FormatDiff(v, c, r->drawn ? r->prev + y * r->xn : 0, r->xn, y,
+                   r->ctx->colors);
+  } else {
+    e = FormatRow(v, c, r->xn, r->ctx->colors);
+  }
+  StopStage(&w, ENCODING);
+  r->len[i] = e - v;
+}
+
+static void RenderRows(struct Render *r) {
+  unsigned y;
+  while ((y = __atomic_fetch_add(&r->y, 1, __ATOMIC_RELAXED)) < r->yn) {
+    if (r->stream) {
+      // wait for the writer to free the slice of y - slots
+      pthread_mutex_lock(&r->lock);
+      while (y >= r->flushed + r->slots) pthread_cond_wait(&r->room, &r->lock);
+      pthread_mutex_unlock(&r->lock);
+      RenderRow(r, y);
+      pthread_mutex_lock(&r->lock);
+      r->ready[y % r->slots] = 1;
+      pthread_cond_signal(&r->done);
+      pthread_mutex_unlock(&r->lock);
+    } else {
+      RenderRow(r, y);
+    }
+  }
+  if (stats_.on) FlushStats();
+}
+
+static void *RenderWorker(void *arg) {
+  unsigned gen;
+  struct Render *r = arg;
+  pthread_mutex_lock(&r->lock);
+  for (gen = 0;;) {
+    while (r->gen == gen && !r->quit) pthread_cond_wait(&r->wake, &r->lock);
+    if (r->quit) break;
+    gen = r->gen;
+    pthread_mutex_unlock(&r->lock);
+    RenderRows(r);
+    pthread_mutex_lock(&r->lock);
+    if (!--r->busy) pthread_cond_signal(&r->idle);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+}
+
+static void FreeRender(struct Render *r);
+
+/**
+ * Makes renderer for images of yn×xn cells packed tightly in memory.
+ *
+ * @param slots is yn to keep every row, as RenderImage() and
+ *     RenderDiff() need, or fewer to stream rows through a ring
+ * @return renderer, or NULL w/ errno if out of memory or threads
+ */
+static struct Render *NewRender(struct derasterize *ctx, unsigned yn,
+                                unsigned xn, unsigned slots) {
+  int rc;
+  unsigned i;
+  struct Render *r;
+  if (!(r = calloc(1, sizeof(*r)))) return 0;
+  r->ctx = ctx;
+  r->yn = yn;
+  r->xn = xn;
+  r->slots = MIN(slots, yn);
+  r->cap = ROWMAX(xn);
+  r->stride = xn * XS * CN;
+  r->n = MAX(1, MIN(ctx->threads, yn));
+  r->vt = valloc(r->slots * r->cap + 16);
+  r->len = malloc(r->slots * sizeof(*r->len));
+  r->ready = calloc(r->slots, 1);
+  r->cell = malloc(r->slots * xn * sizeof(*r->cell));
+  r->prev = malloc(r->slots * xn * sizeof(*r->prev));
+  r->tile = malloc(r->slots * xn * sizeof(*r->tile));
+  r->th = malloc(r->n * sizeof(*r->th));
+  pthread_mutex_init(&r->lock, 0);
+  pthread_cond_init(&r->wake, 0);
+  pthread_cond_init(&r->idle, 0);
+  pthread_cond_init(&r->done, 0);
+  pthread_cond_init(&r->room, 0);
+  if (!r->vt || !r->len || !r->ready || !r->cell || !r->prev || !r->tile ||
+      !r->th) {
+    r->n = 1;
+    FreeRender(r);
+    errno = ENOMEM;
+    return 0;
+  }
+  for (i = 1; i < r->n; ++i) {
+    if ((rc = pthread_create(r->th + i, 0, RenderWorker, r))) {
+      r->n = i;
+      FreeRender(r);
+      errno = rc;
+      return 0;
+    }
+  }
+  return r;
+}
+
+static void FreeRender(struct Render *r) {
+  unsigned i;
+  pthread_mutex_lock(&r->lock);
+  r->quit = 1;
+  pthread_cond_broadcast(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  for (i = 1; i < r->n; ++i) {
+    ORDIE(!pthread_join(r->th[i], 0));
+  }
+  pthread_cond_destroy(&r->room);
+  pthread_cond_destroy(&r->done);
+  pthread_cond_destroy(&r->idle);
+  pthread_cond_destroy(&r->wake);
+  pthread_mutex_destroy(&r->lock);
+  free(r->th);
+  free(r->tile);
+  free(r->prev);
+  free(r->cell);
+  free(r->ready);
+  free(r->len);
+  free(r->vt);
+  free(r);
+}
+
+/**
+ * Renders each row into its own ROWMAX() slice of r->vt, with help from
+ * the thread pool.
+ */
+static void RenderSlices(struct Render *r, const unsigned char *rgb) {
+  pthread_mutex_lock(&r->lock);
+  r->rgb = rgb;
+  r->y = 0;
+  r->stream = 0;
+  r->busy = r->n - 1;
+  r->gen++;
+  pthread_cond_broadcast(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  RenderRows(r);
+  pthread_mutex_lock(&r->lock);
+  while (r->busy) pthread_cond_wait(&r->idle, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Turns packed 8-bit RGB graphic into ANSI UNICODE text.
+ *
+ * Each row is rendered into its own slice of r->vt, possibly on several
+ * threads, then the slices are stitched back together in order so the
+ * output is the same whatever the number of threads.
+ *
+ * @return end of text starting at r->vt, with 16 bytes to spare
+ */
+static char *RenderImage(struct Render *r, const unsigned char *rgb) {
+  char *v;
+  unsigned y;
+  r->diff = 0;
+  RenderSlices(r, rgb);
+  for (v = r->vt, y = 0; y < r->yn; ++y) {
+    if (y) {
+      if (v > r->vt && v[-1] == ' ') --v;
+      *v++ = '\r';
+      *v++ = '\n';
+    }
+    memmove(v, r->vt + y * r->cap, r->len[y]);
+    v += r->len[y];
+  }
+  return v;
+}
+
+#ifndef DERASTERIZE_LIBRARY
+/**
+ * Turns packed 8-bit RGB graphic into ANSI UNICODE text that updates
+ * the previous one drawn at the top left corner of the screen.
+ *
+ * Only the cells that changed are sent, so a mostly static picture
+ * costs little bandwidth, and the whole update is wrapped in DEC mode
+ * 2026 so terminals supporting it never show half a frame. The first
+ * call draws every cell.
+ *
+ * @return end of text starting at r->vt, with 16 bytes to spare
+ */
+static char *RenderDiff(struct Render *r, const unsigned char *rgb) {
+  char *v;
+  unsigned y;
+  struct Cell *t;
+  r->diff = 1;
+  RenderSlices(r, rgb);
+  for (v = r->vt + 8, y = 0; y < r->yn; ++y) {
+    memmove(v, r->vt + y * r->cap, r->len[y]);
+    v += r->len[y];
+  }
+  memcpy(r->vt, "\e[?2026h", 8);
+  memcpy(v, "\e[0m\e[?2026l", 12);
+  t = r->prev;
+  r->prev = r->cell;
+  r->cell = t;
+  r->drawn = 1;
+  return v + 12;
+}
+#endif /* DERASTERIZE_LIBRARY */
+
+/**
+ * Takes rows of text off the hands of RenderStream(), returning nonzero
+ * to stop sending them.
+ */
+typedef int flush_f(void *arg, struct iovec *iov, int n);
+
+/**
+ * Turns packed 8-bit RGB graphic into ANSI UNICODE text, flushing rows
+ * in order as soon as they're done, rather than once all of them are.
+ *
+ * Rows go round a ring of r->slots slices, so memory doesn't grow with
+ * the image. Pool threads render rows ahead while the caller flushes,
+ * and the caller renders rows too whenever the next one to flush isn't
+ * done yet and the ring has room. The text is the same RenderText()
+ * makes, with the colors reset at the end.
+ *
+ * @return 0, or what flush returned the first time it wasn't, after
+ *     which no more rows are rendered
+ */
+static int RenderStream(struct Render *r, const unsigned char *rgb,
+                        flush_f *flush, void *arg) {
+  int rc;
+  char *v;
+  unsigned i, k, n, y, next;
+  struct iovec iov[RINGMAX + 1];
+  static char kReset[] = "\r\e[0m";
+  pthread_mutex_lock(&r->lock);
+  r->rgb = rgb;
+  r->y = 0;
+  r->stream = 1;
+  r->flushed = 0;
+  r->busy = r->n - 1;
+  r->gen++;
+  pthread_cond_broadcast(&r->wake);
+  for (rc = 0, next = 0; next < r->yn;) {
+    if (!r->ready[next % r->slots]) {
+      y = __atomic_load_n(&r->y, __ATOMIC_RELAXED);
+      if (y >= r->yn || y >= next + r->slots) {
+        pthread_cond_wait(&r->done, &r->lock);
+      } else if (__atomic_compare_exchange_n(&r->y, &y, y + 1, 0,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&r->lock);
+        RenderRow(r, y);
+        pthread_mutex_lock(&r->lock);
+        r->ready[y % r->slots] = 1;
+      }
+      continue;
+    }
+    for (k = 1; next + k < r->yn && k < r->slots; ++k) {
+      if (!r->ready[(next + k) % r->slots]) break;
+    }
+    pthread_mutex_unlock(&r->lock);
+    for (n = i = 0; i < k; ++i, ++n) {
+      y = next + i;
+      v = r->vt + y % r->slots * r->cap;
+      iov[n].iov_base = v;
+      iov[n].iov_len = r->len[y % r->slots];
+      if (y + 1 < r->yn) {
+        if (v[iov[n].iov_len - 1] == ' ') --iov[n].iov_len;
+        v[iov[n].iov_len++] = '\r';
+        v[iov[n].iov_len++] = '\n';
+      }
+    }
+    if (next + k == r->yn) {
+      iov[n].iov_base = kReset;
+      iov[n++].iov_len = sizeof(kReset) - 1;
+    }
+    rc = flush(arg, iov, n);
+    pthread_mutex_lock(&r->lock);
+    for (i = 0; i < k; ++i) r->ready[(next + i) % r->slots] = 0;
+    r->flushed = next += k;
+    if (rc) {
+      // nobody's reading, so stop claiming rows, and let the workers
+      // waiting for room finish the one they have
+      __atomic_store_n(&r->y, r->yn, __ATOMIC_RELAXED);
+      r->flushed = r->yn;
+    }
+    pthread_cond_broadcast(&r->room);
+    if (rc) break;
+  }
+  while (r->busy) pthread_cond_wait(&r->idle, &r->lock);
+  memset(r->ready, 0, r->slots);
+  pthread_mutex_unlock(&r->lock);
+  if (stats_.on) FlushStats();
+  return rc;
+}
+
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § library                                                    ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+static void inittables(void) {
+  btoa(0, 0);
+  initlinear();
+  initpalette();
+  initshapes();
+}
+
+/**
+ * Makes context for rendering with options.
+ *
+ * @param opt may be NULL for the defaults
+ * @return DERASTERIZE_OK, or an error with *ctx set to NULL
+ */
+int derasterize_new(struct derasterize **ctx,
+                    const struct derasterize_options *opt) {
+  struct derasterize *c;
+  static const struct derasterize_options kDefaults;
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  static pthread_once_t quantized = PTHREAD_ONCE_INIT;
+  *ctx = 0;
+  if (!opt) opt = &kDefaults;
+  if ((unsigned)opt->quality >= ARRAYLEN(kTiers) || opt->tolerance < 0 ||
+      opt->flat < 0 || opt->smooth < 0 ||
+      (opt->colors && opt->colors != 256 && opt->colors != 16)) {
+    return DERASTERIZE_EINVAL;
+  }
+  pthread_once(&once, inittables);
+  if (opt->colors) pthread_once(&quantized, initquantize);
+  if (!(c = valloc(sizeof(*c)))) return DERASTERIZE_ENOMEM;
+  memset(c, 0, sizeof(*c));
+  c->mode = opt->quality;
+  c->pairs = opt->pairs;
+  c->tolerance = SQR(opt->tolerance) * CN * BN;
+  c->flat = SQR(opt->flat) * CN * BN;
+  c->smooth = SQR(opt->smooth) * CN * BN;
+  c->threads = MAX(1, opt->threads);
+  c->colors = opt->colors;
+  c->shortlist = opt->shortlist;
+  if (pickglyphs(c, opt->glyphs) == -1) {
+    free(c);
+    return DERASTERIZE_EGLYPH;
+  }
+  initglyphs(c);
+  initsearch(c);
+  *ctx = c;
+  return DERASTERIZE_OK;
+}
+
+void derasterize_free(struct derasterize *ctx) {
+  if (!ctx) return;
+  if (ctx->render) FreeRender(ctx->render);
+  free(ctx);
+}
+
+/**
+ * Returns size of buffer derasterize_render() never runs out of.
+ */
+size_t derasterize_bound(unsigned rows, unsigned cols) {
+  return (size_t)rows * ROWMAX(cols) + 16;
+}
+
+/**
+ * Gets renderer of context for image size, unless it's the last one.
+ *
+ * @param slots is rows to keep, as NewRender() takes it
+ */
+static int GetRender(struct derasterize *ctx, unsigned yn, unsigned xn,
+                     size_t stride, unsigned slots) {
+  if (!yn || !xn || stride < xn * XS * CN) return DERASTERIZE_EINVAL;
+  if (ctx->render && (ctx->render->yn != yn || ctx->render->xn != xn ||
+                      ctx->render->slots != MIN(slots, yn))) {
+    FreeRender(ctx->render);
+    ctx->render = 0;
+  }
+  if (!ctx->render && !(ctx->render = NewRender(ctx, yn, xn, slots))) {
+    return errno == ENOMEM ? DERASTERIZE_ENOMEM : DERASTERIZE_ETHREAD;
+  }
+  ctx->render->stride = stride;
+  return DERASTERIZE_OK;
+}
+
+/**
+ * Renders image, returning end of text at r->vt, which ends with the
+ * colors reset.
+ */
+static char *RenderText(struct Render *r, const unsigned char *rgb) {
+  char *v;
+  long long t0;
+  t0 = tick();
+  v = RenderImage(r, rgb);
+  TALLY(render, tick() - t0);
+  *v++ = '\r';
+  *v++ = 033;
+  *v++ = '[';
+  *v++ = '0';
+  *v++ = 'm';
+  return v;
+}
+
+/**
+ * Turns packed 8-bit RGB graphic into ANSI UNICODE text.
+ *
+ * The text goes straight into buf if it has derasterize_bound() bytes,
+ * otherwise it's copied there if it fits.
+ *
+ * @param rgb has rows×cols cells of pixels, which are stride bytes
+ *     apart from one row of pixels to the next
+ * @param len receives length of text, or what it would've been if the
+ *     buffer turned out too small
+ * @return DERASTERIZE_OK, DERASTERIZE_ENOSPC, or another error
+ */
+int derasterize_render(struct derasterize *ctx, const unsigned char *rgb,
+                       size_t stride, unsigned rows, unsigned cols, char *buf,
+                       size_t cap, size_t *len) {
+  int rc;
+  char *v, *vt;
+  struct Render *r;
+  *len = 0;
+  if ((rc = GetRender(ctx, rows, cols, stride, rows))) return rc;
+  r = ctx->render;
+  vt = r->vt;
+  if (cap >= derasterize_bound(rows, cols)) {
+    r->vt = buf;
+    *len = RenderText(r, rgb) - buf;
+    r->vt = vt;
+    return DERASTERIZE_OK;
+  }
+  v = RenderText(r, rgb);
+  if ((*len = v - vt) > cap) return DERASTERIZE_ENOSPC;
+  memcpy(buf, vt, *len);
+  return DERASTERIZE_OK;
+}
+
+/**
+ * Writes vector to file descriptor, picking up where partial writes
+ * left off, and waiting for room if it's non-blocking.
+ */
+static int WriteVector(int fd, struct iovec *iov, int n) {
+  ssize_t rc;
+  struct pollfd pfd;
+  while (n) {
+    if ((rc = writev(fd, iov, n)) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, -1);
+      } else if (errno != EINTR) {
+        return -1;
+      }
+      continue;
+    }
+    for (; n && (size_t)rc >= iov->iov_len; rc -= iov->iov_len, ++iov, --n) {
+    }
+    if (n) {
+      iov->iov_base = (char *)iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return 0;
+}
+
+static int FlushFd(void *arg, struct iovec *iov, int n) {
+  int i, rc;
+  size_t m;
+  struct Stopwatch w;
+  for (m = i = 0; i < n; ++i) m += iov[i].iov_len;
+  StartStage(&w);
+  rc = WriteVector(*(int *)arg, iov, n);
+  StopStage(&w, WRITING);
+  TALLY(bytes, m);
+  return rc;
+}
+
+struct Callback {
+  derasterize_write_f *write;
+  void *arg;
+};
+
+static int FlushCallback(void *arg, struct iovec *iov, int n) {
+  int i;
+  struct Callback *cb = arg;
+  for (i = 0; i < n; ++i) {
+    if (cb->write(cb->arg, iov[i].iov_base, iov[i].iov_len)) return -1;
+  }
+  return 0;
+}
+
+/**
+ * Streams text through a ring of rows, which costs the same memory
+ * whatever the size of the image.
+ */
+static int Stream(struct derasterize *ctx, const unsigned char *rgb,
+                  size_t stride, unsigned rows, unsigned cols, flush_f *flush,
+                  void *arg) {
+  int rc;
+  long long t0;
+  if ((rc = GetRender(ctx, rows, cols, stride,
+                      MIN(RINGMAX, 4 * ctx->threads)))) {
+    return rc;
+  }
+  t0 = tick();
+  rc = RenderStream(ctx->render, rgb, flush, arg);
+  TALLY(render, tick() - t0);
+  return rc ? DERASTERIZE_EWRITE : DERASTERIZE_OK;
+}
+
+/**
+ * Turns packed 8-bit RGB graphic into ANSI UNICODE text, which is handed
+ * to a callback a row or so at a time, as soon as it's ready.
+ *
+ * @return DERASTERIZE_OK, DERASTERIZE_EWRITE if write() returned nonzero,
+ *     or another error
+ */
+int derasterize_stream(struct derasterize *ctx, const unsigned char *rgb,
+                       size_t stride, unsigned rows, unsigned cols,
+                       derasterize_write_f *write, void *arg) {
+  struct Callback cb = {write, arg};
+  return Stream(ctx, rgb, stride, rows, cols, FlushCallback, &cb);
+}
+
+/**
+ * Turns packed 8-bit RGB graphic into ANSI UNICODE text, which is written
+ * to fd a few rows at a time with writev(), as soon as they're ready.
+ *
+ * Partial writes are resumed, and EAGAIN waited out with poll(), so fd
+ * may be non-blocking.
+ *
+ * @return DERASTERIZE_OK, DERASTERIZE_EWRITE if writing failed, or
+ *     another error
+ */
+int derasterize_write(struct derasterize *ctx, const unsigned char *rgb,
+                      size_t stride, unsigned rows, unsigned cols, int fd) {
+  return Stream(ctx, rgb, stride, rows, cols, FlushFd, &fd);
+}
+
+const char *derasterize_strerror(int err) {
+  static const char *const kErrors[] = {
+      [DERASTERIZE_OK] = "success",
+      [DERASTERIZE_ENOMEM] = "out of memory",
+      [DERASTERIZE_EINVAL] = "invalid option or image size",
+      [DERASTERIZE_EGLYPH] = "unknown glyph",
+      [DERASTERIZE_ETHREAD] = "can't create threads",
+      [DERASTERIZE_ENOSPC] = "output buffer too small",
+      [DERASTERIZE_EWRITE] = "write failed",
+  };
+  if ((unsigned)err < ARRAYLEN(kErrors)) return kErrors[err];
+  return "unknown error";
+}
+
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § decoding                                                   ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+static unsigned ReadLe16(const unsigned char *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t ReadLe32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint32_t ReadBe32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+/**
+ * Allocates packed 8-bit RGB graphic, if dimensions are sane.
+ */
+static unsigned char *NewImage(unsigned long yn, unsigned long xn) {
+  if (!yn || !xn || yn > 32767 || xn > 32767) return 0;
+  return malloc(yn * xn * CN);
+}
+
+/**
+ * Reads next header token of netpbm file, skipping comments.
+ */
+static const unsigned char *PnmToken(const unsigned char *p,
+                                     const unsigned char *e) {
+  for (; p < e; ++p) {
+    if (*p == '#') {
+      while (p < e && *p != '\n') ++p;
+    } else if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+      break;
+    }
+  }
+  return p;
+}
+
+/**
+ * Reads unsigned decimal header field of netpbm file.
+ */
+static const unsigned char *PnmNumber(const unsigned char *p,
+                                      const unsigned char *e,
+                                      unsigned long *x) {
+  p = PnmToken(p, e);
+  if (p == e || *p < '0' || *p > '9') return 0;
+  for (*x = 0; p < e && '0' <= *p && *p <= '9'; ++p) {
+    if ((*x = *x * 10 + (*p - '0')) > 65535) return 0;
+  }
+  return p;
+}
+
+/**
+ * Decodes PBM, PGM, PPM, or PAM graphic, plain or raw.
+ *
+ * Alpha channels are dropped, same as convert would do with rgb:-.
+ */
+static unsigned char *DecodePnm(const unsigned char *p, size_t n,
+                                unsigned *yn, unsigned *xn) {
+  char word[16];
+  unsigned char *rgb;
+  const unsigned char *e;
+  unsigned long i, j, k, w, h, d, m, v, b;
+  int kind;
+  if (n < 3 || p[0] != 'P' || p[1] < '1' || p[1] > '7') return 0;
+  kind = p[1] - '0';
+  e = p + n;
+  p += 2;
+  w = h = 0;
+  d = kind == 3 || kind == 6 ? 3 : 1;
+  m = kind == 1 || kind == 4 ? 1 : 0;
+  if (kind == 7) {
+    for (;;) {
+      p = PnmToken(p, e);
+      for (i = 0; p < e && i + 1 < sizeof(word) && *p > ' '; ++p) {
+        word[i++] = *p;
+      }
+      word[i] = 0;
+      if (!strcmp(word, "ENDHDR")) {
+        while (p < e && *p != '\n') ++p;
+        break;
+      } else if (!strcmp(word, "WIDTH")) {
+        if (!(p = PnmNumber(p, e, &w))) return 0;
+      } else if (!strcmp(word, "HEIGHT")) {
+        if (!(p = PnmNumber(p, e, &h))) return 0;
+      } else if (!strcmp(word, "DEPTH")) {
+        if (!(p = PnmNumber(p, e, &d))) return 0;
+      } else if (!strcmp(word, "MAXVAL")) {
+        if (!(p = PnmNumber(p, e, &m))) return 0;
+      } else if (!strcmp(word, "TUPLTYPE")) {
+        while (p < e && *p != '\n') ++p;
+      } else {
+        return 0;
+      }
+    }
+    if (d < 1 || d > 4) return 0;
+  } else {
+    if (!(p = PnmNumber(p, e, &w))) return 0;
+    if (!(p = PnmNumber(p, e, &h))) return 0;
+    if (!m && !(p = PnmNumber(p, e, &m))) return 0;
+  }
+  if (!m || p == e) return 0;
+  ++p; /* single whitespace before raster */
+  if (!(rgb = NewImage(h, w))) return 0;
+  b = m > 255 ? 2 : 1;
+  if (kind == 4) {
+    if ((size_t)(e - p) < h * ((w + 7) / 8)) goto Fail;
+    for (i = 0; i < h; ++i, p += (w + 7) / 8) {
+      for (j = 0; j < w; ++j) {
+        v = p[j / 8] & (0x80 >> (j % 8)) ? 0 : 255;
+        memset(rgb + (i * w + j) * CN, v, CN);
+      }
+    }
+  } else if (kind >= 4 && d == 3 && m == 255) {
+    if ((size_t)(e - p) < h * w * CN) goto Fail;
+    memcpy(rgb, p, h * w * CN);
+  } else if (kind >= 4) {
+    if ((size_t)(e - p) < h * w * d * b) goto Fail;
+    for (i = 0; i < h * w; ++i, p += d * b) {
+      for (k = 0; k < CN; ++k) {
+        v = b == 2 ? p[(d < 3 ? 0 : k) * 2] << 8 | p[(d < 3 ? 0 : k) * 2 + 1]
+                   : p[d < 3 ? 0 : k];
+        rgb[i * CN + k] = (MIN(v, m) * 255 + m / 2) / m;
+      }
+    }
+  } else {
+    for (i = 0; i < h * w; ++i) {
+      for (k = 0; k < d; ++k) {
+        if (kind == 1) {
+          /* plain pbm digits needn't be separated */
+          if ((p = PnmToken(p, e)) == e) goto Fail;
+          v = *p++ == '0';
+        } else {
+          if (!(p = PnmNumber(p, e, &v))) goto Fail;
+          v = (MIN(v, m) * 255 + m / 2) / m;
+        }
+        if (d == 1) {
+          memset(rgb + i * CN, kind == 1 ? v * 255 : v, CN);
+        } else {
+          rgb[i * CN + k] = v;
+        }
+      }
+    }
+  }
+  *yn = h;
+  *xn = w;
+  return rgb;
+Fail:
+  free(rgb);
+  return 0;
+}
+
+/**
+ * Converts bitfield of pixel to 8-bit channel value.
+ */
+static unsigned BmpField(uint32_t x, uint32_t mask) {
+  unsigned s, z;
+  if (!mask) return 0;
+  for (s = 0; !(mask & 1); ++s) mask >>= 1;
+  z = mask;
+  return (((x >> s) & z) * 255ull + z / 2) / z;
+}
+
+/**
+ * Decodes Windows or OS/2 bitmap graphic, if not RLE compressed.
+ */
+static unsigned char *DecodeBmp(const unsigned char *p, size_t n,
+                                unsigned *yn, unsigned *xn) {
+  int32_t sh;
+  uint32_t px, mask[3];
+  unsigned char *rgb;
+  const unsigned char *pal, *row;
+  unsigned long i, j, w, h, off, hdr, bpp, comp, pn, ps, stride, y;
+  if (n < 26 || p[0] != 'B' || p[1] != 'M') return 0;
+  off = ReadLe32(p + 10);
+  hdr = ReadLe32(p + 14);
+  if (hdr == 12) {
+    w = ReadLe16(p + 18);
+    sh = (int16_t)ReadLe16(p + 20);
+    bpp = ReadLe16(p + 24);
+    comp = 0;
+    pn = 0;
+    ps = 3;
+  } else if (hdr >= 40 && n >= 14 + 40) {
+    w = (int32_t)ReadLe32(p + 18);
+    sh = ReadLe32(p + 22);
+    bpp = ReadLe16(p + 28);
+    comp = ReadLe32(p + 30);
+    pn = ReadLe32(p + 46);
+    ps = 4;
+  } else {
+    return 0;
+  }
+  h = sh < 0 ? -(unsigned long)sh : (unsigned long)sh;
+  if (!w || !h || w > 32767 || h > 32767) return 0;
+  if (bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8 && bpp != 16 &&
+      bpp != 24 && bpp != 32) {
+    return 0;
+  }
+  if (bpp == 16) {
+    mask[0] = 0x7c00, mask[1] = 0x03e0, mask[2] = 0x001f;
+  } else {
+    mask[0] = 0xff0000, mask[1] = 0x00ff00, mask[2] = 0x0000ff;
+  }
+  if (comp == 3 || comp == 6) {
+    if ((bpp != 16 && bpp != 32) || n < 14 + 40 + 12) return 0;
+    for (i = 0; i < 3; ++i) mask[i] = ReadLe32(p + 14 + 40 + i * 4);
+  } else if (comp) {
+    return 0;
+  }
+  pal = 0;
+  if (bpp <= 8) {
+    if (!pn || pn > 1u << bpp) pn = 1u << bpp;
+    if (14 + hdr + pn * ps > n) return 0;
+    pal = p + 14 + hdr;
+  }
+  stride = (w * bpp + 31) / 32 * 4;
+  if (off > n || (n - off) / stride < h) return 0;
+  if (!(rgb = NewImage(h, w))) return 0;
+  for (y = 0; y < h; ++y) {
+    row = p + off + (sh < 0 ? y : h - 1 - y) * stride;
+    for (j = 0; j < w; ++j) {
+      if (bpp <= 8) {
+        i = row[j * bpp / 8] >> (8 - bpp - j * bpp % 8) & ((1u << bpp) - 1);
+        i = MIN(i, pn - 1) * ps;
+        rgb[(y * w + j) * CN + 0] = pal[i + 2];
+        rgb[(y * w + j) * CN + 1] = pal[i + 1];
+        rgb[(y * w + j) * CN + 2] = pal[i + 0];
+      } else {
+        if (bpp == 16) {
+          px = ReadLe16(row + j * 2);
+        } else if (bpp == 24) {
+          px = row[j * 3] | row[j * 3 + 1] << 8 | row[j * 3 + 2] << 16;
+        } else {
+          px = ReadLe32(row + j * 4);
+        }
+        for (i = 0; i < CN; ++i) {
+          rgb[(y * w + j) * CN + i] = BmpField(px, mask[i]);
+        }
+      }
+    }
+  }
+  *yn = h;
+  *xn = w;
+  return rgb;
+}
+
+/**
+ * Decodes farbfeld graphic.
+ */
+static unsigned char *DecodeFarbfeld(const unsigned char *p, size_t n,
+                                     unsigned *yn, unsigned *xn) {
+  unsigned char *rgb;
+  unsigned long i, k, w, h;
+  if (n < 16 || memcmp(p, "farbfeld", 8)) return 0;
+  w = ReadBe32(p + 8);
+  h = ReadBe32(p + 12);
+  if (!(rgb = NewImage(h, w))) return 0;
+  if ((n - 16) / 8 / w < h) {
+    free(rgb);
+    return 0;
+  }
+  for (p += 16, i = 0; i < h * w; ++i, p += 8) {
+    for (k = 0; k < CN; ++k) {
+      rgb[i * CN + k] = ((p[k * 2] << 8 | p[k * 2 + 1]) * 255 + 32767) / 65535;
+    }
+  }
+  *yn = h;
+  *xn = w;
+  return rgb;
+}
+
+/**
+ * Decodes Quite OK Image graphic.
+ */
+static unsigned char *DecodeQoi(const unsigned char *p, size_t n,
+                                unsigned *yn, unsigned *xn) {
+  int dg;
+  unsigned char *rgb, px[4], index[64][4];
+  const unsigned char *e;
+  unsigned long i, w, h, run;
+  if (n < 14 + 8 || memcmp(p, "qoif", 4)) return 0;
+  w = ReadBe32(p + 4);
+  h = ReadBe32(p + 8);
+  if (!(rgb = NewImage(h, w))) return 0;
+  e = p + n - 8;
+  p += 14;
+  memset(index, 0, sizeof(index));
+  px[0] = px[1] = px[2] = 0;
+  px[3] = 255;
+  for (run = i = 0; i < h * w; ++i) {
+    if (run) {
+      --run;
+    } else if (p < e) {
+      if (*p == 0xfe) {
+        if (e - p < 4) break;
+        memcpy(px, p + 1, 3);
+        p += 4;
+      } else if (*p == 0xff) {
+        if (e - p < 5) break;
+        memcpy(px, p + 1, 4);
+        p += 5;
+      } else if ((*p & 0xc0) == 0x00) {
+        memcpy(px, index[*p++], 4);
+      } else if ((*p & 0xc0) == 0x40) {
+        px[0] += (*p >> 4 & 3) - 2;
+        px[1] += (*p >> 2 & 3) - 2;
+        px[2] += (*p >> 0 & 3) - 2;
+        ++p;
+      } else if ((*p & 0xc0) == 0x80) {
+        if (e - p < 2) break;
+        dg = (*p & 0x3f) - 32;
+        px[0] += dg - 8 + (p[1] >> 4);
+        px[1] += dg;
+        px[2] += dg - 8 + (p[1] & 15);
+        p += 2;
+      } else {
+        run = *p++ & 0x3f;
+      }
+      memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px,
+             4);
+    } else {
+      break;
+    }
+    memcpy(rgb + i * CN, px, CN);
+  }
+  if (i < h * w) {
+    free(rgb);
+    return 0;
+  }
+  *yn = h;
+  *xn = w;
+  return rgb;
+}
+
+#ifdef HAVE_PNG
+/**
+ * Decodes Portable Network Graphics graphic using libpng.
+ */
+static unsigned char *DecodePng(const unsigned char *p, size_t n,
+                                unsigned *yn, unsigned *xn) {
+  png_image img;
+  unsigned char *rgb;
+  if (n < 8 || memcmp(p, "\211PNG\r\n\032\n", 8)) return 0;
+  memset(&img, 0, sizeof(img));
+  img.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_memory(&img, p, n)) return 0;
+  img.format = PNG_FORMAT_RGB;
+  if (!(rgb = NewImage(img.height, img.width))) {
+    png_image_free(&img);
+    return 0;
+  }
+  if (!png_image_finish_read(&img, 0, rgb, 0, 0)) {
+    free(rgb);
+    return 0;
+  }
+  *yn = img.height;
+  *xn = img.width;
+  return rgb;
+}
+#endif
+
+#ifdef HAVE_JPEG
+struct JpegError {
+  struct jpeg_error_mgr pub;
+  jmp_buf jb;
+};
+
+static void OnJpegError(j_common_ptr cinfo) {
+  longjmp(((struct JpegError *)cinfo->err)->jb, 1);
+}
+
+/**
+ * Decodes JPEG graphic using libjpeg.
+ *
+ * The IDCT is told to scale down by up to 8x as long as the result is
+ * still bigger than what will be displayed, which saves most of the
+ * work on large photos.
+ */
+static unsigned char *DecodeJpeg(const unsigned char *p, size_t n,
+                                 unsigned *yn, unsigned *xn, unsigned dy,
+                                 unsigned dx) {
+  JSAMPROW row;
+  struct JpegError err;
+  struct jpeg_decompress_struct cinfo;
+  unsigned char *volatile rgb;
+  if (n < 3 || p[0] != 0xff || p[1] != 0xd8 || p[2] != 0xff) return 0;
+  rgb = 0;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = OnJpegError;
+  if (setjmp(err.jb)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(rgb);
+    return 0;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *)p, n);
+  jpeg_read_header(&cinfo, TRUE);
+  if (cinfo.jpeg_color_space == JCS_CMYK ||
+      cinfo.jpeg_color_space == JCS_YCCK) {
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+  }
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.scale_num = 1;
+  for (cinfo.scale_denom = 8; cinfo.scale_denom > 1; cinfo.scale_denom /= 2) {
+    if (cinfo.image_width / cinfo.scale_denom >= dx &&
+        cinfo.image_height / cinfo.scale_denom >= dy) {
+      break;
+    }
+  }
+  jpeg_start_decompress(&cinfo);
+  if (!(rgb = NewImage(cinfo.output_height, cinfo.output_width))) {
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+  }
+  while (cinfo.output_scanline < cinfo.output_height) {
+    row = rgb + (size_t)cinfo.output_scanline * cinfo.output_width * CN;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  *yn = cinfo.output_height;
+  *xn = cinfo.output_width;
+  jpeg_destroy_decompress(&cinfo);
+  return rgb;
+}
+#endif
+
+/**
+ * Decodes graphic of any format we know, by sniffing its magic.
+ *
+ * @param dy,dx is the size that'll be displayed, as a hint
+ * @return packed 8-bit RGB, or NULL if format isn't supported
+ */
+static unsigned char *DecodeImage(const unsigned char *p, size_t n,
+                                  unsigned *yn, unsigned *xn,
+                                  unsigned dy unused, unsigned dx unused) {
+  unsigned char *rgb;
+  if ((rgb = DecodePnm(p, n, yn, xn))) return rgb;
+  if ((rgb = DecodeBmp(p, n, yn, xn))) return rgb;
+  if ((rgb = DecodeFarbfeld(p, n, yn, xn))) return rgb;
+  if ((rgb = DecodeQoi(p, n, yn, xn))) return rgb;
+#ifdef HAVE_PNG
+  if ((rgb = DecodePng(p, n, yn, xn))) return rgb;
+#endif
+#ifdef HAVE_JPEG
+  if ((rgb = DecodeJpeg(p, n, yn, xn, dy, dx))) return rgb;
+#endif
+  return 0;
+}
+
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § resampling                                                 ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+#define BOX 0     /* average the area each output pixel covers */
+#define LANCZOS 1 /* windowed sinc with three lobes, sharper but slower */
+
+static int filter_;
+
+/**
+ * Weights of source pixels contributing to each output pixel.
+ *
+ * Every output pixel gets the same number of taps so the loops below
+ * don't branch; short ones are padded with zero weights.
+ */
+struct Filter {
+  unsigned n;      /* taps per output pixel */
+  unsigned *start; /* first source pixel of each output pixel */
+  FLOAT *w;        /* n weights per output pixel */
+};
+
+static FLOAT sinc(FLOAT x) {
+  if (!x) return 1;
+  x *= FLOAT_C(3.14159265358979323846);
+  return FLOAT_C(sin)(x) / x;
+}
+
+/**
+ * Computes weights for resampling an axis of sn pixels to dn.
+ */
+static void NewFilter(struct Filter *f, unsigned sn, unsigned dn) {
+  long i, j, a;
+  FLOAT scale, half, c, t, w, sum, *ws;
+  scale = (FLOAT)sn / dn;
+  half = filter_ == LANCZOS ? 3 * MAX(scale, 1) : scale / 2;
+  f->n = MIN(sn, (unsigned)FLOAT_C(ceil)(2 * half) + 1);
+  ORDIE((f->start = malloc(dn * sizeof(*f->start))));
+  ORDIE((f->w = calloc(dn * f->n, sizeof(*f->w))));
+  for (i = 0; i < dn; ++i) {
+    c = (i + FLOAT_C(.5)) * scale;
+    a = FLOAT_C(floor)(c - half);
+    a = MIN(MAX(0, a), (long)(sn - f->n));
+    f->start[i] = a;
+    ws = f->w + i * f->n;
+    for (sum = j = 0; j < f->n; ++j) {
+      if (filter_ == LANCZOS) {
+        t = (a + j + FLOAT_C(.5) - c) / MAX(scale, 1);
+        w = ABS(t) < 3 ? sinc(t) * sinc(t / 3) : 0;
+      } else {
+        w = MIN(a + j + 1, c + half) - MAX(a + j, c - half);
+        w = MAX(0, w);
+      }
+      sum += (ws[j] = w);
+    }
+    for (j = 0; j < f->n; ++j) ws[j] /= sum;
+  }
+}
+
+static void FreeFilter(struct Filter *f) {
+  free(f->start);
+  free(f->w);
+}
+
+/**
+ * Resampler from one size to another, keeping its buffers around so
+ * video frames can be resized without allocating.
+ */
+struct Resizer {
+  unsigned sy, sx, dy, dx;
+  unsigned a; /* output rows pending at once */
+  struct Filter fy, fx;
+  FLOAT *lin, *acc;
+  unsigned char *res;
+};
+
+static struct Resizer *NewResizer(unsigned sy, unsigned sx, unsigned dy,
+                                  unsigned dx) {
+  unsigned y, i;
+  struct Resizer *z;
+  ORDIE((z = calloc(1, sizeof(*z))));
+  z->sy = sy;
+  z->sx = sx;
+  z->dy = dy;
+  z->dx = dx;
+  NewFilter(&z->fy, sy, dy);
+  NewFilter(&z->fx, sx, dx);
+  for (y = 0; y < dy; ++y) {
+    for (i = y; i < dy && z->fy.start[i] < z->fy.start[y] + z->fy.n; ++i) {
+    }
+    z->a = MAX(z->a, i - y);
+  }
+  ORDIE((z->res = valloc((size_t)dy * dx * CN)));
+  ORDIE((z->lin = valloc(CN * sx * sizeof(FLOAT))));
+  ORDIE((z->acc = valloc((size_t)z->a * CN * sx * sizeof(FLOAT))));
+  return z;
+}
+
+static void FreeResizer(struct Resizer *z) {
+  free(z->acc);
+  free(z->lin);
+  free(z->res);
+  FreeFilter(&z->fx);
+  FreeFilter(&z->fy);
+  free(z);
+}
+
+/**
+ * Resizes packed 8-bit RGB graphic in linear light.
+ *
+ * Source rows are read once, linearized through kLinear while being
+ * split into channel planes, and added with their vertical weight to
+ * every output row whose window they fall in. That's a long multiply
+ * add over the row which vectorizes well, and only a handful of output
+ * rows are pending at any time. Once complete, an output row is then
+ * filtered horizontally and converted back to sRGB through kSrgb.
+ *
+ * @return z->res
+ */
+static unsigned char *Resize(struct Resizer *z, const unsigned char *rgb) {
+  unsigned char *dst;
+  const unsigned char *src;
+  unsigned y, x, k, t, i, j, a, lo, hi, sx, dx;
+  FLOAT v, w, *row, *lin, *acc;
+  const struct Filter *fy, *fx;
+  fy = &z->fy;
+  fx = &z->fx;
+  sx = z->sx;
+  dx = z->dx;
+  a = z->a;
+  lin = z->lin;
+  acc = z->acc;
+  for (lo = hi = j = 0; j < z->sy; ++j) {
+    src = rgb + (size_t)j * sx * CN;
+    for (x = 0; x < sx; ++x) {
+      for (k = 0; k < CN; ++k) {
+        lin[k * sx + x] = kLinear[src[x * CN + k]];
+      }
+    }
+    for (; hi < z->dy && fy->start[hi] <= j; ++hi) {
+      memset(acc + hi % a * CN * sx, 0, CN * sx * sizeof(FLOAT));
+    }
+    for (y = lo; y < hi; ++y) {
+      w = fy->w[y * fy->n + j - fy->start[y]];
+      row = acc + y % a * CN * sx;
+      for (i = 0; i < CN * sx; ++i) row[i] += w * lin[i];
+    }
+    for (; lo < hi && fy->start[lo] + fy->n - 1 == j; ++lo) {
+      row = acc + lo % a * CN * sx;
+      dst = z->res + (size_t)lo * dx * CN;
+      for (k = 0; k < CN; ++k) {
+        for (x = 0; x < dx; ++x) {
+          for (v = t = 0; t < fx->n; ++t) {
+            v += fx->w[x * fx->n + t] * row[k * sx + fx->start[x] + t];
+          }
+          v = MIN(MAX(v, 0), 1);
+          dst[x * CN + k] = kSrgb[(unsigned)(v * 65535 + FLOAT_C(.5))];
+        }
+      }
+    }
+  }
+  return z->res;
+}
+
+/**
+ * Resizes packed 8-bit RGB graphic, which is freed.
+ */
+static unsigned char *ResizeImage(unsigned char *rgb, unsigned sy,
+                                  unsigned sx, unsigned dy, unsigned dx) {
+  unsigned char *res;
+  struct Resizer *z;
+  if (sy == dy && sx == dx) return rgb;
+  z = NewResizer(sy, sx, dy, dx);
+  res = Resize(z, rgb);
+  z->res = 0;
+  FreeResizer(z);
+  free(rgb);
+  return res;
+}
+
+#ifndef DERASTERIZE_LIBRARY
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § video                                                      ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+#define RAW 0  /* packed rgb24 frames of a size given with -s */
+#define PPM 1  /* concatenated binary pixmaps, e.g. ffmpeg -f image2pipe */
+#define Y4M 2  /* yuv4mpeg2, e.g. ffmpeg -f yuv4mpegpipe */
+
+static unsigned streamy_, streamx_;
+static double fps_;
+
+/**
+ * Buffered reader for frames piped on stdin.
+ */
+struct Stream {
+  int fd;
+  size_t i, n;
+  unsigned char b[65536];
+};
+
+static int StreamFill(struct Stream *s) {
+  ssize_t rc;
+  if (s->i < s->n) return 1;
+  do rc = read(s->fd, s->b, sizeof(s->b));
+  while (rc == -1 && errno == EINTR);
+  ORDIE(rc != -1);
+  s->i = 0;
+  s->n = rc;
+  return rc > 0;
+}
+
+static int StreamGetc(struct Stream *s) {
+  return StreamFill(s) ? s->b[s->i++] : -1;
+}
+
+/**
+ * Reads exactly n bytes, going around the buffer for large amounts.
+ *
+ * @return 0 on end of stream
+ */
+static int StreamRead(struct Stream *s, unsigned char *p, size_t n) {
+  size_t m;
+  ssize_t rc;
+  m = MIN(n, s->n - s->i);
+  memcpy(p, s->b + s->i, m);
+  s->i += m;
+  for (p += m, n -= m; n; p += rc, n -= rc) {
+    do rc = read(s->fd, p, n);
+    while (rc == -1 && errno == EINTR);
+    ORDIE(rc != -1);
+    if (!rc) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Reads header line without its newline, truncating it to fit.
+ *
+ * @return 0 on end of stream
+ */
+static int StreamLine(struct Stream *s, char *p, size_t n) {
+  int c;
+  size_t i;
+  for (i = 0; (c = StreamGetc(s)) != -1 && c != '\n';) {
+    if (i + 1 < n) p[i++] = c;
+  }
+  p[i] = 0;
+  return c != -1;
+}
+
+static unsigned long StreamNumber(struct Stream *s) {
+  int c;
+  unsigned long x;
+  while ((c = StreamGetc(s)) == '#' || isspace(c)) {
+    if (c == '#') {
+      while ((c = StreamGetc(s)) != -1 && c != '\n') {
+      }
+    }
+  }
+  for (x = 0; '0' <= c && c <= '9'; c = StreamGetc(s)) {
+    x = MIN(x * 10 + c - '0', 65535);
+  }
+  return x;
+}
+
+/**
+ * Video source, with the buffers of whichever format it turned out to be.
+ */
+struct Video {
+  struct Stream s;
+  int kind;
+  unsigned yn, xn;         /* frame dimensions */
+  unsigned cy, cx;         /* y4m chroma plane dimensions, 0 if mono */
+  int full;                /* y4m uses 0..255 rather than 16..235 */
+  unsigned char *yuv, *rgb;
+};
+
+/**
+ * Parses yuv4mpeg2 stream header after its signature.
+ */
+static void OpenY4m(struct Video *v, char *h) {
+  char *t;
+  unsigned long n, d;
+  const char *c = "420";
+  for (t = strtok(h, " "); t; t = strtok(0, " ")) {
+    switch (*t++) {
+      case 'W':
+        v->xn = strtoul(t, 0, 10);
+        break;
+      case 'H':
+        v->yn = strtoul(t, 0, 10);
+        break;
+      case 'F':
+        n = strtoul(t, &t, 10);
+        d = *t == ':' ? strtoul(t + 1, 0, 10) : 1;
+        if (!fps_ && d) fps_ = (double)n / d;
+        break;
+      case 'C':
+        c = t;
+        break;
+      case 'X':
+        if (!strcmp(t, "COLORRANGE=FULL")) v->full = 1;
+        break;
+      default:
+        break;
+    }
+  }
+  // 8-bit only, e.g. C420p10 has samples of two bytes
+  if (!strcmp(c, "420") || !strcmp(c, "420jpeg") || !strcmp(c, "420paldv") ||
+      !strcmp(c, "420mpeg2")) {
+    v->cy = (v->yn + 1) / 2;
+    v->cx = (v->xn + 1) / 2;
+  } else if (!strcmp(c, "422")) {
+    v->cy = v->yn;
+    v->cx = (v->xn + 1) / 2;
+  } else if (!strcmp(c, "444")) {
+    v->cy = v->yn;
+    v->cx = v->xn;
+  } else if (strcmp(c, "mono")) {
+    fprintf(stderr, "y4m colorspace C%s unsupported\n", c);
+    exit(EXIT_FAILURE);
+  }
+  ORDIE(0 < v->yn && v->yn <= 32767 && 0 < v->xn && v->xn <= 32767);
+  ORDIE((v->yuv = malloc((size_t)v->yn * v->xn + 2 * v->cy * v->cx)));
+}
+
+/**
+ * Works out stream format from its first bytes.
+ */
+static void OpenVideo(struct Video *v, int fd) {
+  char h[512];
+  memset(v, 0, sizeof(*v));
+  v->s.fd = fd;
+  if (!StreamFill(&v->s)) exit(EXIT_SUCCESS);
+  if (v->s.n >= 10 && !memcmp(v->s.b, "YUV4MPEG2 ", 10)) {
+    v->kind = Y4M;
+    StreamLine(&v->s, h, sizeof(h));
+    OpenY4m(v, h + 10);
+  } else if (v->s.n >= 2 && !memcmp(v->s.b, "P6", 2)) {
+    v->kind = PPM;
+  } else if (streamy_ && streamx_) {
+    v->kind = RAW;
+    v->yn = streamy_;
+    v->xn = streamx_;
+  } else {
+    fputs("raw rgb24 video needs -s WxH\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Converts planar BT.601 frame to packed 8-bit RGB.
+ */
+static void Y4mToRgb(struct Video *v) {
+  long c, d, e, k, l;
+  unsigned y, x, i;
+  unsigned char *p;
+  const unsigned char *Y, *U, *V;
+  /* 16.16 fixed point coefficients for limited and full range */
+  static const long kYuv[2][5] = {
+      {76309, 104597, 25675, 53279, 132201}, /* 255/219, 255/224 */
+      {65536, 91881, 22554, 46802, 116130},
+  };
+  const long *m = kYuv[v->full];
+  p = v->rgb;
+  for (y = 0; y < v->yn; ++y) {
+    Y = v->yuv + (size_t)y * v->xn;
+    U = v->yuv + (size_t)v->yn * v->xn + y * v->cy / v->yn * v->cx;
+    V = U + (size_t)v->cy * v->cx;
+    for (x = 0; x < v->xn; ++x) {
+      c = (Y[x] - (v->full ? 0 : 16)) * m[0] + 32768;
+      if (v->cx) {
+        i = x * v->cx / v->xn;
+        d = U[i] - 128;
+        e = V[i] - 128;
+      } else {
+        d = e = 0;
+      }
+      k = (c + m[1] * e) >> 16;
+      l = (c - m[2] * d - m[3] * e) >> 16;
+      *p++ = MIN(MAX(k, 0), 255);
+      *p++ = MIN(MAX(l, 0), 255);
+      k = (c + m[4] * d) >> 16;
+      *p++ = MIN(MAX(k, 0), 255);
+    }
+  }
+}
+
+/**
+ * Reads next frame, reallocating only if its size changed.
+ *
+ * @return v->rgb or NULL at end of stream
+ */
+static unsigned char *ReadFrame(struct Video *v) {
+  char h[512];
+  unsigned yn, xn;
+  switch (v->kind) {
+    case PPM:
+      if (StreamGetc(&v->s) != 'P' || StreamGetc(&v->s) != '6') return 0;
+      xn = StreamNumber(&v->s);
+      yn = StreamNumber(&v->s);
+      ORDIE(StreamNumber(&v->s) == 255);
+      ORDIE(0 < yn && yn <= 32767 && 0 < xn && xn <= 32767);
+      if (yn != v->yn || xn != v->xn) {
+        free(v->rgb);
+        v->rgb = 0;
+        v->yn = yn;
+        v->xn = xn;
+      }
+      break;
+    case Y4M:
+      if (!StreamLine(&v->s, h, sizeof(h))) return 0;
+      ORDIE(!strncmp(h, "FRAME", 5));
+      if (!StreamRead(&v->s, v->yuv,
+                      (size_t)v->yn * v->xn + 2 * v->cy * v->cx)) {
+        return 0;
+      }
+      break;
+    default:
+      break;
+  }
+  if (!v->rgb) ORDIE((v->rgb = valloc((size_t)v->yn * v->xn * CN)));
+  if (v->kind == Y4M) {
+    Y4mToRgb(v);
+  } else if (!StreamRead(&v->s, v->rgb, (size_t)v->yn * v->xn * CN)) {
+    return 0;
+  }
+  return v->rgb;
+}
+
+static void WriteAll(int fd, const char *p, size_t n) {
+  struct iovec iov = {(char *)p, n};
+  ORDIE(!WriteVector(fd, &iov, 1));
+}
+
+static void OnVideoDone(int sig) {
+  static const char kRestore[] = "\e[0m\e[?25h\r\n";
+  write(1, kRestore, sizeof(kRestore) - 1);
+  _exit(128 + sig);
+}
+
+static void SleepUntil(long long t) {
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000;
+  ts.tv_nsec = t % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR) {
+  }
+}
+
+/**
+ * Plays video piped on stdin, redrawing what changed of each frame.
+ *
+ * Frame i is due fps_ seconds apart from the first. A frame read once
+ * the next one is already due gets dropped without being rendered, so
+ * playback keeps to the clock when the terminal or renderer are slower
+ * than the video. Everything is allocated for the first frame and then
+ * reused, so the loop doesn't touch the heap unless the size changes.
+ */
+static void PlayVideo(struct derasterize *ctx, unsigned yn, unsigned xn) {
+  char *e;
+  unsigned long i;
+  long long t0, dt;
+  unsigned char *rgb;
+  struct Video *v;
+  struct Render *r;
+  struct Resizer *z;
+  struct Stopwatch w;
+  unsigned sy, sx;
+  ORDIE((v = malloc(sizeof(*v))));
+  OpenVideo(v, STDIN_FILENO);
+  signal(SIGINT, OnVideoDone);
+  signal(SIGTERM, OnVideoDone);
+  signal(SIGPIPE, OnVideoDone);
+  WriteAll(1, "\e[?25l\e[2J", 10);
+  ORDIE((r = NewRender(ctx, yn, xn, yn)));
+  z = 0;
+  sy = sx = 0;
+  dt = fps_ > 0 ? 1e9 / fps_ : 0;
+  for (t0 = Nanos(), i = 0;; ++i) {
+    StartStage(&w);
+    rgb = ReadFrame(v);
+    StopStage(&w, DECODING);
+    if (!rgb) break;
+    if (dt && Nanos() >= t0 + (long long)(i + 1) * dt) continue;
+    if (v->yn != yn * YS || v->xn != xn * XS) {
+      StartStage(&w);
+      if (!z || v->yn != sy || v->xn != sx) {
+        if (z) FreeResizer(z);
+        z = NewResizer((sy = v->yn), (sx = v->xn), yn * YS, xn * XS);
+      }
+      rgb = Resize(z, rgb);
+      StopStage(&w, RESIZING);
+    }
+    StartStage(&w);
+    e = RenderDiff(r, rgb);
+    TALLY(render, tick() - w.wall);
+    if (dt) SleepUntil(t0 + (long long)i * dt);
+    StartStage(&w);
+    WriteAll(1, r->vt, e - r->vt);
+    StopStage(&w, WRITING);
+    TALLY(bytes, e - r->vt);
+    TALLY(cells, yn * xn);
+    TALLY(frames, 1);
+  }
+  WriteAll(1, "\e[?25h\r\n", 8);
+  if (z) FreeResizer(z);
+  FreeRender(r);
+  free(v->rgb);
+  free(v->yuv);
+  free(v);
+}
+
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § systems                                                    ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+static int progressive_;
+
+/**
+ * Formats picture as lower half blocks, colored with the means of the
+ * upper and lower halves of each block, which is what basicidea.c does
+ * and costs next to nothing compared to searching the glyphs.
+ *
+ * @return end of text, which leaves the cursor on the last row
+ */
+static char *PreviewImage(char *v, const struct derasterize *ctx,
+                          const unsigned char *rgb, unsigned yn, unsigned xn) {
+  unsigned y, x, i, j, k, s[2][CN];
+  const unsigned char *p;
+  struct Cell c, c1;
+  c.rune = u'▄';
+  for (y = 0; y < yn; ++y) {
+    if (y) {
+      *v++ = '\r';
+      *v++ = '\n';
+    }
+    c1.rune = 0;
+    for (x = 0; x < xn; ++x) {
+      memset(s, 0, sizeof(s));
+      for (i = 0; i < YS; ++i) {
+        p = rgb + ((size_t)(y * YS + i) * xn + x) * XS * CN;
+        for (j = 0; j < XS * CN; j += CN) {
+          for (k = 0; k < CN; ++k) s[i >= YS / 2][k] += p[j + k];
+        }
+      }
+      for (k = 0; k < CN; ++k) {
+        c.bg[k] = (s[0][k] + BN / 4) / (BN / 2);
+        c.fg[k] = (s[1][k] + BN / 4) / (BN / 2);
+      }
+      if (ctx->colors) {
+        c.bg[0] = quantize(ctx->colors, c.bg[0], c.bg[1], c.bg[2]);
+        c.fg[0] = quantize(ctx->colors, c.fg[0], c.fg[1], c.fg[2]);
+        c.bg[1] = c.bg[2] = c.fg[1] = c.fg[2] = 0;
+      }
+      v = celltoa(v, c, &c1, ctx->colors);
+    }
+  }
+  return v;
+}
+
+struct Refine {
+  int fd;
+  unsigned rows; /* left to draw over the preview */
+};
+
+/**
+ * Writes rows of the picture over its preview, erasing each line first,
+ * since rows leave out a trailing space, which the preview would show
+ * through otherwise.
+ */
+static int FlushRefine(void *arg, struct iovec *iov, int n) {
+  int i, m;
+  struct Refine *f = arg;
+  struct iovec v[RINGMAX * 2 + 2];
+  static char kErase[] = "\e[0m\e[K";
+  for (m = i = 0; i < n; ++i) {
+    if (f->rows) {
+      f->rows--;
+      v[m].iov_base = kErase;
+      v[m++].iov_len = sizeof(kErase) - 1;
+    }
+    v[m++] = iov[i];
+  }
+  return FlushFd(&f->fd, v, m);
+}
+
+/**
+ * Prints picture, which with -p is previewed as half blocks at once,
+ * and then redrawn in place row by row, as soon as each one is found.
+ */
+static void PrintImage(struct derasterize *ctx, void *rgb, unsigned yn,
+                       unsigned xn) {
+  int rc;
+  char *v, *e;
+  struct Stopwatch w;
+  struct Refine f = {1, yn};
+  if (progressive_) {
+    StartStage(&w);
+    ORDIE((v = malloc(yn * (ROWMAX(xn) + 2) + 32)));
+    e = PreviewImage(v, ctx, rgb, yn, xn);
+    e += sprintf(e, "\e[0m\r");
+    if (yn > 1) e += sprintf(e, "\e[%uA", yn - 1);
+    StopStage(&w, ENCODING);
+    StartStage(&w);
+    WriteAll(1, v, e - v);
+    StopStage(&w, WRITING);
+    TALLY(bytes, e - v);
+    free(v);
+    rc = Stream(ctx, rgb, xn * XS * CN, yn, xn, FlushRefine, &f);
+  } else {
+    rc = derasterize_write(ctx, rgb, xn * XS * CN, yn, xn, 1);
+  }
+  if (rc) {
+    fprintf(stderr, "%s\n", derasterize_strerror(rc));
+    exit(EXIT_FAILURE);
+  }
+  TALLY(cells, yn * xn);
+  TALLY(frames, 1);
+}
+
+/**
+ * Starts keeping the totals printed by PrintStats().
+ *
+ * Cycles and instructions are counted by the kernel for this thread and
+ * the threads it creates afterwards, if perf_event_open() lets us.
+ */
+static void StartStats(void) {
+#ifdef __linux__
+  int i;
+  struct perf_event_attr pe;
+  static const unsigned long long kEvents[2] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+  };
+  int *fds[2] = {&stats_.cycles, &stats_.instructions};
+  for (i = 0; i < 2; ++i) {
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = kEvents[i];
+    pe.inherit = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    *fds[i] = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+  }
+#else
+  stats_.cycles = stats_.instructions = -1;
+#endif
+  stats_.on = 1;
+}
+
+static long long ReadCounter(int fd) {
+  long long n;
+  if (fd == -1 || read(fd, &n, sizeof(n)) != sizeof(n)) return -1;
+  return n;
+}
+
+static const char kStages[STAGES][10] = {
+    "decode", "resize",  "tile",   "match", "linearize",
+    "pairs",  "scoring", "encode", "write",
+};
+
+/**
+ * Prints where time went for --stats, once every thread is joined.
+ */
+static void PrintStats(struct derasterize *ctx) {
+  unsigned i, g;
+  char rune[8];
+  long long cycles, instructions;
+  unsigned long cells;
+  if (ctx->render) {
+    FreeRender(ctx->render);
+    ctx->render = 0;
+  }
+  FlushStats();
+  cells = MAX(1, stats_.cells);
+  fprintf(stderr, "%-12s %10s %10s\n", "stage", "wall ms", "cpu ms");
+  for (i = 0; i < STAGES; ++i) {
+    if (LINEARIZING <= i && i <= SCORING) {
+      fprintf(stderr, "  %-10s %10.3f %10s\n", kStages[i],
+              stats_.wall[i] / 1e6, "-");
+    } else {
+      fprintf(stderr, "%-12s %10.3f %10.3f\n", kStages[i],
+              stats_.wall[i] / 1e6, stats_.cpu[i] / 1e6);
+    }
+  }
+  fprintf(stderr, "%lu cells in %lu frames rendered in %.3f ms, %.0f cells/s\n",
+          stats_.cells, stats_.frames, stats_.render / 1e6,
+          stats_.render ? stats_.cells / (stats_.render / 1e9) : 0.);
+  fprintf(stderr, "%lu bytes output, %.2f bytes/cell\n", stats_.bytes,
+          (double)stats_.bytes / cells);
+  fprintf(stderr, "%lu searches exited early\n", stats_.exits);
+#if MEMO
+  fprintf(stderr, "%lu memo hits, %lu misses\n", ctx->memohits,
+          ctx->memomisses);
+#endif
+  fprintf(stderr, "%lu flat, %lu smooth, %lu detailed blocks\n",
+          ctx->efforts[FLAT], ctx->efforts[SMOOTH], ctx->efforts[DETAILED]);
+  cycles = ReadCounter(stats_.cycles);
+  instructions = ReadCounter(stats_.instructions);
+  if (cycles != -1 && instructions != -1) {
+    fprintf(stderr, "%.0f cycles, %.0f instructions per cell\n",
+            (double)cycles / cells, (double)instructions / cells);
+  }
+  fprintf(stderr, "glyph usage:\n");
+  for (g = 0; g < GT; ++g) {
+    if (stats_.glyphs[g]) {
+      *tptoa(rune, kRunes[g]) = 0;
+      fprintf(stderr, "%10lu %s\n", stats_.glyphs[g], rune);
+    }
+  }
+}
+
+/**
+ * Determines dimensions of teletypewriter to default to full screen output
+ */
+static void GetTermSize(unsigned *out_rows, unsigned *out_cols) {
+  struct winsize ws;
+  ws.ws_row = 24;
+  ws.ws_col = 80;
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1) {
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+  }
+  *out_rows = ws.ws_row;
+  *out_cols = ws.ws_col;
+}
+#endif /* DERASTERIZE_LIBRARY */
+
+/**
+ * Reads from file descriptor until end of file.
+ *
+ * @return NULL if reading fails, e.g. fd is a directory
+ */
+static unsigned char *ReadToEnd(int fd, size_t *n) {
+  ssize_t rc;
+  size_t cap;
+  unsigned char *p;
+  *n = 0;
+  cap = 65536;
+  ORDIE((p = malloc(cap)));
+  while ((rc = read(fd, p + *n, cap - *n))) {
+    if (rc == -1) {
+      if (errno == EINTR) continue;
+      free(p);
+      return 0;
+    }
+    if ((*n += rc) == cap) ORDIE((p = realloc(p, (cap *= 2))));
+  }
+  return p;
+}
+
+/**
+ * Has ImageMagick decode a format we don't know to a PPM.
+ *
+ * @return NULL if convert couldn't
+ */
+static unsigned char *ConvertImage(char *path, size_t *n) {
+  int pid, ws, rw[2];
+  unsigned char *p;
+  ORDIE(pipe(rw) != -1);
+  if (!(pid = fork())) {
+    close(rw[0]);
+    dup2(rw[1], STDOUT_FILENO);
+    execlp("convert", "convert", path, "-depth", "8", "ppm:-", NULL);
+    _exit(EXIT_FAILURE);
+  }
+  close(rw[1]);
+  p = ReadToEnd(rw[0], n);
+  close(rw[0]);
+  while (waitpid(pid, &ws, 0) == -1) ORDIE(errno == EINTR);
+  if (p && !(WIFEXITED(ws) && !WEXITSTATUS(ws))) {
+    free(p);
+    p = 0;
+  }
+  return p;
+}
+
+/**
+ * Decodes image file and resizes it to exactly dy×dx pixels.
+ *
+ * @return NULL if neither we nor ImageMagick could decode it
+ */
+static unused unsigned char *LoadImage(char *path, unsigned dy, unsigned dx) {
+  int fd;
+  size_t n;
+  unsigned sy, sx;
+  unsigned char *p, *rgb;
+  struct Stopwatch w;
+  rgb = 0;
+  StartStage(&w);
+  if ((fd = open(path, O_RDONLY)) != -1) {
+    if ((p = ReadToEnd(fd, &n))) {
+      rgb = DecodeImage(p, n, &sy, &sx, dy, dx);
+      free(p);
+    }
+    close(fd);
+  }
+  if (!rgb && (p = ConvertImage(path, &n))) {
+    rgb = DecodePnm(p, n, &sy, &sx);
+    free(p);
+  }
+  StopStage(&w, DECODING);
+  if (!rgb) return 0;
+  StartStage(&w);
+  rgb = ResizeImage(rgb, sy, sx, dy, dx);
+  StopStage(&w, RESIZING);
+  return rgb;
+}
+
+#ifndef DERASTERIZE_LIBRARY
+static unsigned char *LoadImageOrDie(char *path, unsigned yn, unsigned xn) {
+  unsigned char *rgb;
+  ORDIE((rgb = LoadImage(path, yn * YS, xn * XS)));
+  return rgb;
+}
+
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § daemon                                                     ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+#define IMAGEFILE 0 /* payload is absolute path of image file */
+#define IMAGEDATA 1 /* payload is height×width packed rgb24 */
+
+#define MAXCELLS 512   /* most rows or columns of cells a client may ask */
+#define MAXPIXELS 4096 /* most rows or columns of pixels it may send */
+
+/**
+ * Request sent to daemon, followed by size bytes of payload.
+ *
+ * Fields are in host byte order, since client and daemon share a host.
+ * Programs that already have pixels, e.g. a file browser's thumbnails,
+ * send them as IMAGEDATA rather than having them decoded again.
+ */
+struct Request {
+  char magic[4]; /* "DRZ1" */
+  uint32_t kind; /* IMAGEFILE or IMAGEDATA */
+  uint32_t quality, rows, cols, height, width, size;
+};
+
+/**
+ * Reply of daemon, followed by size bytes of text if status is OK.
+ */
+struct Reply {
+  int32_t status; /* DERASTERIZE_OK, an error, or -1 if no image loaded */
+  uint32_t size;
+};
+
+struct Cached {
+  unsigned long long key, used;
+  size_t n;
+  char *p;
+};
+
+struct Daemon {
+  unsigned long long uses;
+  unsigned cachen;
+  struct Cached *cache;
+  struct derasterize_options opt;
+  struct derasterize *tiers[ARRAYLEN(kTiers)];
+};
+
+static int daemon_, connect_;
+static char *socket_;
+static char bound_[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static unsigned cachen_ = 64;
+
+static unsigned long long hashbytes(unsigned long long h, const void *p,
+                                    size_t n) {
+  uint64_t w;
+  const unsigned char *s = p;
+  for (; n >= 8; s += 8, n -= 8) {
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 31;
+  }
+  for (; n; --n) h = (h ^ *s++) * 0x100000001B3ull;
+  return h;
+}
+
+/**
+ * Picks path of socket, by default in the runtime directory of user.
+ *
+ * @return 0, or -1 if the path doesn't fit, rather than cut it short
+ *     and have it name some other file
+ */
+static int SocketAddress(struct sockaddr_un *sa) {
+  int n;
+  const char *d;
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  if (socket_ && *socket_) {
+    n = snprintf(sa->sun_path, sizeof(sa->sun_path), "%s", socket_);
+  } else if ((d = getenv("XDG_RUNTIME_DIR")) && *d) {
+    n = snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/derasterize.sock",
+                 d);
+  } else {
+    n = snprintf(sa->sun_path, sizeof(sa->sun_path),
+                 "/tmp/derasterize-%u.sock", (unsigned)getuid());
+  }
+  return n >= 0 && (size_t)n < sizeof(sa->sun_path) ? 0 : -1;
+}
+
+/**
+ * Returns nonzero if path is a socket of our own user.
+ *
+ * Anyone could have made one by that name in /tmp, and would get to
+ * see our paths and write whatever they like to our terminal, and a
+ * path that's something else mustn't be unlinked as if it were stale.
+ */
+static int IsOurSocket(const char *path) {
+  struct stat st;
+  return lstat(path, &st) != -1 && S_ISSOCK(st.st_mode) &&
+         st.st_uid == getuid();
+}
+
+static int RecvAll(int fd, void *p, size_t n) {
+  ssize_t rc;
+  for (; n; p = (char *)p + rc, n -= rc) {
+    do rc = recv(fd, p, n, 0);
+    while (rc == -1 && errno == EINTR);
+    if (rc <= 0) return -1;
+  }
+  return 0;
+}
+
+static int SendAll(int fd, const void *p, size_t n) {
+  ssize_t rc;
+  for (; n; p = (const char *)p + rc, n -= rc) {
+    do rc = send(fd, p, n, MSG_NOSIGNAL);
+    while (rc == -1 && errno == EINTR);
+    if (rc == -1) return -1;
+  }
+  return 0;
+}
+
+static void Answer(int fd, int status, const char *p, size_t n) {
+  struct Reply a = {status, status ? 0 : n};
+  if (!SendAll(fd, &a, sizeof(a)) && !status) SendAll(fd, p, n);
+}
+
+/**
+ * Finds text rendered for key, or else the slot to render it into.
+ *
+ * Slots are few enough that a scan beats keeping a list in order of
+ * use: the least recently used one is evicted once all are taken.
+ */
+static struct Cached *Lookup(struct Daemon *d, unsigned long long key) {
+  unsigned i;
+  struct Cached *c, *lru;
+  for (lru = c = d->cache, i = 0; i < d->cachen; ++i, ++c) {
+    if (c->p && c->key == key) {
+      c->used = ++d->uses;
+      return c;
+    }
+    if (c->used < lru->used) lru = c;
+  }
+  return lru;
+}
+
+/**
+ * Answers one request, which names or carries an image to render.
+ */
+static void Serve(struct Daemon *d, int fd) {
+  int rc;
+  size_t n, cap;
+  char *v, path[PATH_MAX];
+  unsigned char *rgb;
+  unsigned long long key, id[5];
+  struct stat st;
+  struct Request q;
+  struct Cached *c;
+  struct derasterize_options opt;
+  if (RecvAll(fd, &q, sizeof(q)) || memcmp(q.magic, "DRZ1", 4) ||
+      q.quality >= ARRAYLEN(kTiers) || !q.rows || q.rows > MAXCELLS ||
+      !q.cols || q.cols > MAXCELLS) {
+    Answer(fd, DERASTERIZE_EINVAL, 0, 0);
+    return;
+  }
+  rgb = 0;
+  key = hashbytes(PHIPRIME, &q, sizeof(q));
+  if (q.kind == IMAGEFILE && q.size < sizeof(path)) {
+    if (RecvAll(fd, path, q.size)) return;
+    path[q.size] = 0;
+    if (stat(path, &st) == -1) {
+      Answer(fd, -1, 0, 0);
+      return;
+    }
+    // same file unless it's been written since
+    id[0] = st.st_dev;
+    id[1] = st.st_ino;
+    id[2] = st.st_size;
+    id[3] = st.st_mtim.tv_sec;
+    id[4] = st.st_mtim.tv_nsec;
+    key = hashbytes(hashbytes(key, path, q.size), id, sizeof(id));
+  } else if (q.kind == IMAGEDATA && q.height && q.height <= MAXPIXELS &&
+             q.width && q.width <= MAXPIXELS &&
+             q.size == (size_t)q.height * q.width * CN) {
+    ORDIE((rgb = malloc(q.size)));
+    if (RecvAll(fd, rgb, q.size)) {
+      free(rgb);
+      return;
+    }
+    key = hashbytes(key, rgb, q.size);
+  } else {
+    Answer(fd, DERASTERIZE_EINVAL, 0, 0);
+    return;
+  }
+  c = d->cachen ? Lookup(d, key) : 0;
+  if (c && c->p && c->key == key) {
+    free(rgb);
+    Answer(fd, DERASTERIZE_OK, c->p, c->n);
+    return;
+  }
+  if (q.kind == IMAGEFILE) {
+    rgb = LoadImage(path, q.rows * YS, q.cols * XS);
+  } else {
+    rgb = ResizeImage(rgb, q.height, q.width, q.rows * YS, q.cols * XS);
+  }
+  if (!rgb) {
+    Answer(fd, -1, 0, 0);
+    return;
+  }
+  if (!d->tiers[q.quality]) {
+    opt = d->opt;
+    opt.quality = q.quality;
+    if ((rc = derasterize_new(&d->tiers[q.quality], &opt))) {
+      free(rgb);
+      Answer(fd, rc, 0, 0);
+      return;
+    }
+  }
+  cap = derasterize_bound(q.rows, q.cols);
+  ORDIE((v = malloc(cap)));
+  rc = derasterize_render(d->tiers[q.quality], rgb, q.cols * XS * CN, q.rows,
+                          q.cols, v, cap, &n);
+  free(rgb);
+  Answer(fd, rc, v, n);
+  if (!rc && c) {
+    free(c->p);
+    c->key = key;
+    c->used = ++d->uses;
+    c->n = n;
+    if (!(c->p = realloc(v, n))) c->p = v;
+  } else {
+    free(v);
+  }
+}
+
+static void OnDaemonDone(int sig) {
+  unlink(bound_);
+  _exit(128 + sig);
+}
+
+/**
+ * Renders images for clients until killed, one request at a time.
+ *
+ * Every request is rendered on all threads of the context for its
+ * quality, which are made on first use and then kept warm, as are
+ * the memo and the cache of whole pictures.
+ */
+static void RunDaemon(struct derasterize *ctx,
+                      const struct derasterize_options *opt) {
+  int fd, cfd;
+  mode_t mask;
+  struct Daemon d;
+  struct stat st;
+  struct sockaddr_un sa;
+  struct timeval tv = {2, 0};
+  memset(&d, 0, sizeof(d));
+  d.opt = *opt;
+  d.tiers[opt->quality] = ctx;
+  d.cachen = cachen_;
+  ORDIE((d.cache = calloc(MAX(1, d.cachen), sizeof(*d.cache))));
+  if (SocketAddress(&sa) == -1) {
+    fprintf(stderr, "%s...: socket path too long\n", sa.sun_path);
+    exit(255);
+  }
+  ORDIE((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) != -1);
+  if (!connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+    fprintf(stderr, "%s: daemon already running\n", sa.sun_path);
+    exit(255);
+  }
+  // nobody answering means it was left by a daemon that died
+  if (lstat(sa.sun_path, &st) != -1 || errno != ENOENT) {
+    if (!IsOurSocket(sa.sun_path)) {
+      fprintf(stderr, "%s: exists and isn't our socket\n", sa.sun_path);
+      exit(255);
+    }
+    unlink(sa.sun_path);
+  }
+  close(fd);
+  ORDIE((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) != -1);
+  mask = umask(077);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+    fprintf(stderr, "%s: %s\n", sa.sun_path, strerror(errno));
+    exit(255);
+  }
+  umask(mask);
+  memcpy(bound_, sa.sun_path, sizeof(bound_));
+  ORDIE(listen(fd, 64) != -1);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, OnDaemonDone);
+  signal(SIGTERM, OnDaemonDone);
+  signal(SIGHUP, OnDaemonDone);
+  for (;;) {
+    if ((cfd = accept(fd, 0, 0)) == -1) {
+      ORDIE(errno == EINTR || errno == ECONNABORTED || errno == EMFILE ||
+            errno == ENFILE);
+      continue;
+    }
+    fcntl(cfd, F_SETFD, FD_CLOEXEC);
+    // so a client that stalls can't hold up the others for long
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    Serve(&d, cfd);
+    close(cfd);
+  }
+}
+
+/**
+ * Has daemon render image file, copying its text to stdout.
+ *
+ * @return 0 on success, or -1 if no daemon answered, in which case the
+ *     caller renders the image itself
+ */
+static int RenderRemotely(char *path, int quality, unsigned yn, unsigned xn) {
+  int fd;
+  ssize_t rc;
+  size_t n;
+  char abs[PATH_MAX], buf[65536];
+  struct Reply a;
+  struct Request q;
+  struct sockaddr_un sa;
+  if (yn > MAXCELLS || xn > MAXCELLS || !realpath(path, abs) ||
+      SocketAddress(&sa) == -1 || !IsOurSocket(sa.sun_path)) {
+    return -1;
+  }
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) return -1;
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+    close(fd);
+    return -1;
+  }
+  memcpy(q.magic, "DRZ1", 4);
+  q.kind = IMAGEFILE;
+  q.quality = quality;
+  q.rows = yn;
+  q.cols = xn;
+  q.height = q.width = 0;
+  q.size = strlen(abs);
+  if (SendAll(fd, &q, sizeof(q)) || SendAll(fd, abs, q.size) ||
+      RecvAll(fd, &a, sizeof(a))) {
+    close(fd);
+    return -1;
+  }
+  if (a.status == -1) exit(EXIT_FAILURE);
+  if (a.status) {
+    fprintf(stderr, "%s\n", derasterize_strerror(a.status));
+    exit(255);
+  }
+  for (n = a.size; n; n -= rc) {
+    do rc = read(fd, buf, MIN(n, sizeof(buf)));
+    while (rc == -1 && errno == EINTR);
+    ORDIE(rc > 0);
+    WriteAll(1, buf, rc);
+  }
+  close(fd);
+  return 0;
+}
+
+/*───────────────────────────────────────────────────────────────────────────│─╗
+│ derasterize § batch                                                      ─╬─│┼
+╚────────────────────────────────────────────────────────────────────────────│*/
+
+#define QN 2 /* pictures each stage may get ahead of the next */
+
+struct Job {
+  char *path;
+  unsigned char *rgb;
+  char *text;
+  size_t n;
+};
+
+/**
+ * Hands jobs from one stage to the next, blocking either when full or
+ * empty, so memory is bounded by how far ahead the stages may run.
+ */
+struct Queue {
+  unsigned head, tail;
+  struct Job *jobs[QN];
+  pthread_mutex_t lock;
+  pthread_cond_t put, got;
+};
+
+struct Batch {
+  unsigned yn, xn, jn, bad;
+  char **paths;
+  struct Job *jobs;
+  struct Queue decoded, rendered;
+};
+
+static char *outdir_;
+static char *suffix_ = ".uaart";
+
+static void InitQueue(struct Queue *q) {
+  q->head = q->tail = 0;
+  ORDIE(!pthread_mutex_init(&q->lock, 0));
+  ORDIE(!pthread_cond_init(&q->put, 0));
+  ORDIE(!pthread_cond_init(&q->got, 0));
+}
+
+static void DestroyQueue(struct Queue *q) {
+  pthread_cond_destroy(&q->got);
+  pthread_cond_destroy(&q->put);
+  pthread_mutex_destroy(&q->lock);
+}
+
+/**
+ * Enqueues job, where NULL tells the next stage there's no more.
+ */
+static void Push(struct Queue *q, struct Job *j) {
+  pthread_mutex_lock(&q->lock);
+  while (q->tail - q->head == QN) pthread_cond_wait(&q->got, &q->lock);
+  q->jobs[q->tail++ % QN] = j;
+  pthread_cond_signal(&q->put);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static struct Job *Pop(struct Queue *q) {
+  struct Job *j;
+  pthread_mutex_lock(&q->lock);
+  while (q->tail == q->head) pthread_cond_wait(&q->put, &q->lock);
+  j = q->jobs[q->head++ % QN];
+  pthread_cond_signal(&q->got);
+  pthread_mutex_unlock(&q->lock);
+  return j;
+}
+
+static void *DecodeWorker(void *arg) {
+  unsigned i;
+  struct Batch *b = arg;
+  for (i = 0; i < b->jn; ++i) {
+    b->jobs[i].path = b->paths[i];
+    b->jobs[i].rgb = LoadImage(b->paths[i], b->yn * YS, b->xn * XS);
+    Push(&b->decoded, b->jobs + i);
+  }
+  Push(&b->decoded, 0);
+  FlushStats();
+  return 0;
+}
+
+/**
+ * Writes text of job to stdout, or to a file in outdir_ named after the
+ * picture, e.g. -o out turns samples/wave.png into out/wave.png.uaart
+ */
+static int Save(struct Job *j) {
+  int fd;
+  char *name, *path;
+  if (!outdir_) {
+    // the text ends on its last row, which the next picture mustn't draw over
+    WriteAll(1, j->text, j->n);
+    WriteAll(1, "\n", 1);
+    return 0;
+  }
+  name = strrchr(j->path, '/') ? strrchr(j->path, '/') + 1 : j->path;
+  ORDIE((path = malloc(strlen(outdir_) + 1 + strlen(name) +
+                       strlen(suffix_) + 1)));
+  sprintf(path, "%s/%s%s", outdir_, name, suffix_);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    free(path);
+    return -1;
+  }
+  WriteAll(fd, j->text, j->n);
+  close(fd);
+  free(path);
+  return 0;
+}
+
+static void *WriteWorker(void *arg) {
+  struct Job *j;
+  struct Batch *b = arg;
+  struct Stopwatch w;
+  while ((j = Pop(&b->rendered))) {
+    StartStage(&w);
+    if (Save(j) == -1) __atomic_fetch_add(&b->bad, 1, __ATOMIC_RELAXED);
+    StopStage(&w, WRITING);
+    TALLY(bytes, j->n + !outdir_);
+    free(j->text);
+    j->text = 0;
+  }
+  FlushStats();
+  return 0;
+}
+
+/**
+ * Converts every picture named on the command line in one process.
+ *
+ * Decoding picture i+1, rendering picture i and writing picture i-1 all
+ * happen at once, each on threads of their own, with renders spread
+ * over the threads of the context as usual.
+ *
+ * @return number of pictures that couldn't be decoded or saved
+ */
+static unsigned RunBatch(struct derasterize *ctx, char **paths, unsigned jn,
+                         unsigned yn, unsigned xn) {
+  int rc;
+  size_t cap;
+  struct Job *j;
+  struct Batch b;
+  pthread_t decoder, writer;
+  b.yn = yn;
+  b.xn = xn;
+  b.jn = jn;
+  b.bad = 0;
+  b.paths = paths;
+  ORDIE((b.jobs = calloc(jn, sizeof(*b.jobs))));
+  InitQueue(&b.decoded);
+  InitQueue(&b.rendered);
+  ORDIE(!pthread_create(&decoder, 0, DecodeWorker, &b));
+  ORDIE(!pthread_create(&writer, 0, WriteWorker, &b));
+  cap = derasterize_bound(yn, xn);
+  while ((j = Pop(&b.decoded))) {
+    if (!j->rgb) {
+      fprintf(stderr, "%s: can't decode\n", j->path);
+      __atomic_fetch_add(&b.bad, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    ORDIE((j->text = malloc(cap)));
+    rc = derasterize_render(ctx, j->rgb, xn * XS * CN, yn, xn, j->text, cap,
+                            &j->n);
+    free(j->rgb);
+    j->rgb = 0;
+    if (rc) {
+      fprintf(stderr, "%s: %s\n", j->path, derasterize_strerror(rc));
+      exit(255);
+    }
+    TALLY(cells, yn * xn);
+    TALLY(frames, 1);
+    Push(&b.rendered, j);
+  }
+  Push(&b.rendered, 0);
+  pthread_join(decoder, 0);
+  pthread_join(writer, 0);
+  DestroyQueue(&b.rendered);
+  DestroyQueue(&b.decoded);
+  free(b.jobs);
+  return b.bad;
+}
+
+/**
+ * Parses value of flag, which has to be a number, so that e.g. -x with
+ * a file but no number doesn't silently take the file as its value.
+ */
+static double NumberOrDie(const char *flag, const char *s) {
+  char *e;
+  double x;
+  x = strtod(s, &e);
+  if (e == s || *e) {
+    fprintf(stderr, "%s wants a number, not '%s'\n", flag, s);
+    exit(255);
+  }
+  return x;
+}
+
+/**
+ * Parses value of flag, which has to be a whole number, since strtoul()
+ * would take e.g. --cache=-1 for the largest one there is.
+ */
+static unsigned CountOrDie(const char *flag, const char *s) {
+  char *e;
+  unsigned long x;
+  errno = 0;
+  x = strtoul(s, &e, 10);
+  if (*s < '0' || *s > '9' || *e || errno || x > UINT_MAX) {
+    fprintf(stderr, "%s wants a count, not '%s'\n", flag, s);
+    exit(255);
+  }
+  return x;
+}
+
+int main(int argc, char *argv[]) {
+  int i, rc;
+  char *option, **files;
+  void *rgb;
+  unsigned j, fn, yd, xd;
+  int y=0, x=0;
+  struct derasterize *ctx;
+  struct derasterize_options opt = {.quality = MODE};
+
+  // Must provide at least one filename
+  if (argc < 2) {
+   printf (HELPTEXT);
+   exit (255);
+  }
+
+  // Dirty option parsing without getopt
+  ORDIE((files = malloc(argc * sizeof(*files))));
+  for (fn = 0, i = 1; i < argc; ++i) {
+    option= argv[i]; // option=-y12
+    switch( (int) option[0] ) {
+       case '/': // dos style, unless it's an absolute path
+           if (strchr(option + 1, '/') || !access(option, F_OK)) {
+               files[fn++] = option;
+               break;
+           }
+           /* fallthrough */
+       case '-': // unix style
+           if (!option[1]) { // stdin
+               files[fn++] = option;
+               break;
+           }
+           option++; // option=y12
+           switch( (int) option[0]) {
+                 case 'x':
+                    x = NumberOrDie("-x", option[1] || i + 1 == argc
+                                                 ? option + 1
+                                                 : argv[++i]);
                     break;
                  case 'y':
-                    y = atoi(++option);
+                    y = NumberOrDie("-y", option[1] || i + 1 == argc
+                                                 ? option + 1
+                                                 : argv[++i]);
+                    break;
+                 case 'o':
+                    outdir_ = option[1] || i + 1 == argc ? option + 1
+                                                         : argv[++i];
+                    break;
+                 case 'f':
+                    option = option[1] || i + 1 == argc ? option + 1 : argv[++i];
+                    filter_ = !strcmp(option, "lanczos") ? LANCZOS : BOX;
+                    break;
+                 case 'j':
+                    opt.threads = NumberOrDie("-j", option[1] || i + 1 == argc
+                                                        ? option + 1
+                                                        : argv[++i]);
+                    break;
+                 case 's':
+                    option = option[1] || i + 1 == argc ? option + 1 : argv[++i];
+                    streamx_ = strtoul(option, &option, 10);
+                    streamy_ = *option ? strtoul(option + 1, 0, 10) : 0;
+                    break;
+                 case 'r':
+                    fps_ = NumberOrDie("-r", option[1] || i + 1 == argc
+                                                 ? option + 1
+                                                 : argv[++i]);
+                    break;
+                 case 'p':
+                    progressive_ = 1;
+                    break;
+                 case 'c':
+                    opt.colors = NumberOrDie("-c", option[1] || i + 1 == argc
+                                                       ? option + 1
+                                                       : argv[++i]);
+                    break;
+                 case 'q':
+                    option = option[1] || i + 1 == argc ? option + 1 : argv[++i];
+                    for (j = 0; j < ARRAYLEN(kTiers); ++j) {
+                      if (!strcmp(option, kTiers[j].name)) break;
+                    }
+                    if (j == ARRAYLEN(kTiers)) {
+                      fprintf(stderr, "Unknown quality %s\n", option);
+                      exit(255);
+                    }
+                    opt.quality = j;
+                    break;
+                 case '-': // long options
+                    if (!strncmp(option, "-pairs=", 7)) {
+                      opt.pairs = CountOrDie("--pairs", option + 7);
+                    } else if (!strncmp(option, "-glyphs=", 8)) {
+                      opt.glyphs = option + 8;
+                    } else if (!strncmp(option, "-tolerance=", 11)) {
+                      opt.tolerance = NumberOrDie("--tolerance", option + 11);
+                    } else if (!strncmp(option, "-flat=", 6)) {
+                      opt.flat = NumberOrDie("--flat", option + 6);
+                    } else if (!strncmp(option, "-smooth=", 8)) {
+                      opt.smooth = NumberOrDie("--smooth", option + 8);
+                    } else if (!strncmp(option, "-shortlist=", 11)) {
+                      opt.shortlist = CountOrDie("--shortlist", option + 11);
+                    } else if (!strcmp(option, "-stats")) {
+                      stats_.on = 1;
+                    } else if (!strncmp(option, "-daemon", 7) &&
+                               (!option[7] || option[7] == '=')) {
+                      daemon_ = 1;
+                      socket_ = option + 7 + !!option[7];
+                    } else if (!strncmp(option, "-connect", 8) &&
+                               (!option[8] || option[8] == '=')) {
+                      connect_ = 1;
+                      socket_ = option + 8 + !!option[8];
+                    } else if (!strncmp(option, "-cache=", 7)) {
+                      cachen_ = CountOrDie("--cache", option + 7);
+                    } else if (!strncmp(option, "-suffix=", 8)) {
+                      suffix_ = option + 8;
+                    } else {
+                      printf("Unknown option %s\n\n", option);
+                    }
                     break;
                  case 'h':
                     printf (HELPTEXT);
@@ -1128,10 +5105,20 @@ int main(int argc, char *argv[]) {
                  default:
                     printf( "Unknown option %c\n\n",  (int) option[0]);
            } // switch
+           break;
        default:
-           filename=option;
+           files[fn++] = option;
     } // switch
    } //for i
+   if (!fn && !daemon_) {
+     printf (HELPTEXT);
+     exit (255);
+   }
+
+  // Use all online processors unless told otherwise
+  if (!opt.threads) {
+    opt.threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+  }
 
   // Use termize to default to full screen if no x and y are given
   GetTermSize(&yd, &xd);
@@ -1146,10 +5133,48 @@ int main(int argc, char *argv[]) {
         x += xd;
   }
 
+  // Going back up to refine the preview needs all of it on screen
+  if (!isatty(STDOUT_FILENO) || y <= 0 || (unsigned)y > yd) {
+    progressive_ = 0;
+  }
+
+  // Leave it to the daemon if one is running
+  if (connect_ && fn == 1 && !outdir_ && strcmp(files[0], "-") &&
+      !RenderRemotely(files[0], opt.quality, y, x)) {
+    return 0;
+  }
+
+  // Pick the glyphs and search effort before rendering anything
+  if (stats_.on) StartStats();
+  if ((rc = derasterize_new(&ctx, &opt))) {
+    if (rc == DERASTERIZE_EGLYPH) {
+      fprintf(stderr, "Unknown glyph in %s\n", opt.glyphs);
+    } else {
+      fprintf(stderr, "%s\n", derasterize_strerror(rc));
+    }
+    exit(255);
+  }
+
+  // Serve other invocations until killed
+  if (daemon_) {
+    RunDaemon(ctx, &opt);
+  }
+
   // FIXME: on the conversion stage should do 2Y because of halfblocks
   // printf( "filename >%s<\tx >%d<\ty >%d<\n\n", filename, x, y);
-  rgb = LoadImageOrDie(filename, y, x);
-  PrintImage(rgb, y, x);
-  free(rgb);
-  return 0;
+  rc = 0;
+  if (fn > 1 || outdir_) {
+    rc = RunBatch(ctx, files, fn, y, x) ? EXIT_FAILURE : 0;
+  } else if (!strcmp(files[0], "-")) {
+    PlayVideo(ctx, y, x);
+  } else {
+    rgb = LoadImageOrDie(files[0], y, x);
+    PrintImage(ctx, rgb, y, x);
+    free(rgb);
+  }
+  if (stats_.on) PrintStats(ctx);
+  derasterize_free(ctx);
+  free(files);
+  return rc;
 }
+#endif /* DERASTERIZE_LIBRARY */
@@ -0,0 +1,85 @@
+#ifndef DERASTERIZE_H_
+#define DERASTERIZE_H_
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libderasterize renders pictures as unicode ANSI art in-process.
+ *
+ * A context holds the tables for one set of options, as well as the
+ * thread pool and buffers of the last size rendered. Each context is
+ * used by one thread at a time, but any number of them can render at
+ * once. Nothing exits the process: functions return DERASTERIZE_OK or
+ * one of the error codes below.
+ *
+ * Images are packed 8-bit RGB, with DERASTERIZE_CELLHEIGHT rows and
+ * DERASTERIZE_CELLWIDTH columns of pixels for every cell of text, so
+ * the caller resizes them beforehand. The library is built for one size
+ * of cells, 8×4 unless defined otherwise, e.g. 16×8 for finer glyphs,
+ * and callers must be built with the same definitions.
+ */
+
+#ifndef DERASTERIZE_CELLHEIGHT
+#define DERASTERIZE_CELLHEIGHT 8
+#endif
+#ifndef DERASTERIZE_CELLWIDTH
+#define DERASTERIZE_CELLWIDTH 4
+#endif
+
+#define DERASTERIZE_OK 0
+#define DERASTERIZE_ENOMEM 1   /* out of memory */
+#define DERASTERIZE_EINVAL 2   /* bad option or image size */
+#define DERASTERIZE_EGLYPH 3   /* glyph isn't one that can be drawn */
+#define DERASTERIZE_ETHREAD 4  /* couldn't create threads */
+#define DERASTERIZE_ENOSPC 5   /* output buffer too small */
+#define DERASTERIZE_EWRITE 6   /* write callback failed */
+
+#define DERASTERIZE_BEST 0
+#define DERASTERIZE_FAST 1
+#define DERASTERIZE_FASTER 2
+#define DERASTERIZE_MEANS 3
+
+/**
+ * Options of a context, which zero-initialized are the defaults.
+ */
+struct derasterize_options {
+  int quality;        /* DERASTERIZE_BEST etc. */
+  unsigned pairs;     /* most color pairs to consider, 0 as quality says */
+  const char *glyphs; /* count or UTF-8 runes, NULL as quality says */
+  double tolerance;   /* RMS distance that's good enough, 0 for exact */
+  double flat;        /* RMS below which blocks are painted flat, or 0 */
+  double smooth;      /* RMS below which blocks get less effort, or 0 */
+  unsigned threads;   /* render threads, counting the caller, 0 for 1 */
+  unsigned colors;    /* xterm palette size, 256 or 16, or 0 for 24-bit */
+  unsigned shortlist; /* glyphs scored per cell, nearest in shape, 0 all */
+};
+
+struct derasterize;
+
+/**
+ * Writes n bytes of text, returning nonzero to stop rendering.
+ */
+typedef int derasterize_write_f(void *arg, const char *p, size_t n);
+
+int derasterize_new(struct derasterize **ctx,
+                    const struct derasterize_options *opt);
+void derasterize_free(struct derasterize *ctx);
+
+size_t derasterize_bound(unsigned rows, unsigned cols);
+int derasterize_render(struct derasterize *ctx, const unsigned char *rgb,
+                       size_t stride, unsigned rows, unsigned cols, char *buf,
+                       size_t cap, size_t *len);
+int derasterize_stream(struct derasterize *ctx, const unsigned char *rgb,
+                       size_t stride, unsigned rows, unsigned cols,
+                       derasterize_write_f *write, void *arg);
+int derasterize_write(struct derasterize *ctx, const unsigned char *rgb,
+                      size_t stride, unsigned rows, unsigned cols, int fd);
+
+const char *derasterize_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* DERASTERIZE_H_ */
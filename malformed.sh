@@ -0,0 +1,48 @@
+#!/bin/sh
+# Feed pictures with broken headers through derasterize, which has to turn
+# them down with an error rather than crash, and decode the odd good ones
+d=$(mktemp -d) || exit 1
+trap 'rm -rf "$d"' EXIT
+bad=0
+
+le16() {
+  printf "\\$(printf %o $(($1 & 255)))\\$(printf %o $(($1 >> 8 & 255)))"
+}
+le32() {
+  le16 $(($1 & 65535))
+  le16 $(($1 >> 16 & 65535))
+}
+# bmp BPP COMP: 2x2 BMP with a 40-byte header, then what's piped to it
+bmp() {
+  printf BM; le32 0; le32 0; le32 54; le32 40; le32 2; le32 2
+  le16 1; le16 $1; le32 $2; le32 0; le32 0; le32 0; le32 0; le32 0
+  cat
+}
+# refuse FILE: must exit with an error of its own, not a signal
+refuse() {
+  ./derasterize.c -y2 -x2 "$d/$1" >/dev/null 2>&1
+  rc=$?
+  if [ $rc -eq 0 ] || [ $rc -gt 128 ]; then
+    echo "$1: exit status $rc"
+    bad=1
+  fi
+}
+
+for bpp in 0 3 5 6 7 9 15 64; do
+  head -c 64 /dev/zero | bmp $bpp 0 >"$d/bpp$bpp.bmp"
+  refuse bpp$bpp.bmp
+done
+head -c 54 /dev/zero | bmp 8 0 | head -c 54 >"$d/nopalette.bmp"
+refuse nopalette.bmp
+
+# channel masks of all 32 bits make every pixel of ones white
+{ le32 4294967295; le32 4294967295; le32 4294967295
+  printf '\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377'
+} | bmp 32 3 >"$d/mask32.bmp"
+if ! ./derasterize.c -y2 -x2 "$d/mask32.bmp" | grep -q '255;255;255'; then
+  echo "mask32.bmp: not decoded as white"
+  bad=1
+fi
+
+[ $bad -eq 0 ] && echo "Malformed pictures turned down"
+exit $bad